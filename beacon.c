@@ -1,23 +1,268 @@
 #include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <ifaddrs.h>
 #include <syslog.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "socketcand.h"
 #include "beacon.h"
+#include "statistics.h"
+#include "metrics.h"
+
+/* seconds between two broadcasts, 0 only answers queries */
+int beacon_interval = BEACON_INTERVAL;
+
+/* add the load of the daemon to the beacon */
+int beacon_load = 0;
+
+static char beacon[BEACON_LENGTH];
+static int beacon_len;
+static int static_len; /* length of the beacon up to the load hints */
+
+static char hints[BEACON_LENGTH / 2];
+static double hints_time = 0;
+static unsigned long long *hints_frames; /* frames per bus at hints_time */
+static unsigned long long cpu_busy, cpu_total;
+
+/* IPv4 subnets of the host, queries from other addresses are ignored */
+static struct {
+	in_addr_t addr;
+	in_addr_t mask;
+} nets[BEACON_NETS];
+static int net_count;
+
+static double query_tokens = BEACON_QUERY_BURST;
+static double query_time;
+
+/* append the load hints and the end tag to the static part of the beacon */
+static void beacon_finish(void)
+{
+	int n = static_len;
+
+	n += snprintf(beacon + n, BEACON_LENGTH - n, "%s</CANBeacon>", hints);
+
+	beacon_len = (n < BEACON_LENGTH) ? n : BEACON_LENGTH - 1;
+}
+
+/*
+ * Build the beacon. Its content only changes with the hostname, so it is
+ * built when the thread starts and after the addresses of the host changed.
+ */
+static void beacon_build(void)
+{
+	char hostname[32];
+	int i, n;
+
+	gethostname(hostname, sizeof(hostname));
+	hostname[sizeof(hostname) - 1] = '\0';
+
+	n = snprintf(beacon, BEACON_LENGTH, "<CANBeacon name=\"%s\" type=\"%s\" description=\"%s\">\n<URL>can://%s:%d</URL>",
+		     hostname, BEACON_TYPE, description, inet_ntoa(saddr.sin_addr), port);
+
+	for(i=0;i<interface_count && n<BEACON_LENGTH;i++)
+		n += snprintf(beacon + n, BEACON_LENGTH - n, "<Bus name=\"%s\"/>", interface_names[i]);
+
+	static_len = (n < BEACON_LENGTH) ? n : BEACON_LENGTH - 1;
+	beacon_finish();
+}
+
+/* CPU usage of the host in percent since the last call, -1 for the first one */
+static int beacon_cpu(void)
+{
+	unsigned long long v[8], busy, total;
+	int i, ret = -1;
+	FILE *f;
+
+	if(!(f = fopen("/proc/stat", "r")))
+		return -1;
+
+	if(fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		  &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8) {
+		for(i=0, total=0;i<8;i++)
+			total += v[i];
+		/* idle and iowait */
+		busy = total - v[3] - v[4];
+
+		if(cpu_total && total > cpu_total)
+			ret = (busy - cpu_busy) * 100 / (total - cpu_total);
+		cpu_busy = busy;
+		cpu_total = total;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Update the load hints from counters that exist anyway: the connections
+ * in the metrics, the frame counters of the interfaces and /proc/stat.
+ * Rates need a previous sample and are left out in the first beacon.
+ */
+static void beacon_hints(double now)
+{
+	struct rtnl_link_stats64 stats;
+	unsigned long long frames;
+	int i, clients, cpu, ifindex;
+	size_t n;
+	double elapsed = now - hints_time;
+
+	if(!beacon_load || (hints_time && elapsed < BEACON_HINTS_INTERVAL))
+		return;
+
+	if(!hints_frames && !(hints_frames = calloc(interface_count, sizeof(*hints_frames))))
+		return;
+
+	n = snprintf(hints, sizeof(hints), "<Load");
+
+	clients = metrics_connections();
+	if(clients >= 0)
+		n += snprintf(hints + n, sizeof(hints) - n, " clients=\"%d\"", clients);
+
+	cpu = beacon_cpu();
+	if(cpu >= 0)
+		n += snprintf(hints + n, sizeof(hints) - n, " cpu=\"%d\"", cpu);
+
+	n += snprintf(hints + n, sizeof(hints) - n, "/>");
+
+	for(i=0;i<interface_count && n<sizeof(hints);i++) {
+		ifindex = if_nametoindex(interface_names[i]);
+		if(!ifindex || statistics_link(ifindex, &stats) < 0)
+			continue;
+
+		/* frames received and sent by this host are both on the bus */
+		frames = stats.rx_packets + stats.tx_packets;
+		if(hints_time && frames >= hints_frames[i])
+			n += snprintf(hints + n, sizeof(hints) - n, "<Rate bus=\"%s\" fps=\"%.0f\"/>",
+				      interface_names[i], (frames - hints_frames[i]) / elapsed);
+		hints_frames[i] = frames;
+	}
+
+	if(n >= sizeof(hints))
+		hints[0] = '\0';
+
+	hints_time = now;
+	beacon_finish();
+}
+
+
+/* collect the subnets of all interfaces that are up, including loopback */
+static void beacon_nets(void)
+{
+	struct ifaddrs *ifaddr, *ifa;
+
+	net_count = 0;
+	if(getifaddrs(&ifaddr) < 0)
+		return;
+
+	for(ifa = ifaddr; ifa && net_count < BEACON_NETS; ifa = ifa->ifa_next) {
+		if(!ifa->ifa_addr || !ifa->ifa_netmask || ifa->ifa_addr->sa_family != AF_INET)
+			continue;
+		nets[net_count].addr = ((struct sockaddr_in *) ifa->ifa_addr)->sin_addr.s_addr;
+		nets[net_count].mask = ((struct sockaddr_in *) ifa->ifa_netmask)->sin_addr.s_addr;
+		net_count++;
+	}
+
+	freeifaddrs(ifaddr);
+}
+
+/*
+ * A query is only answered if it comes from a subnet of the host, if it is
+ * at least as long as the answer and while the rate of the answers is below
+ * BEACON_QUERY_RATE. So the daemon sends no more than it receives and cannot
+ * be used to flood a host with beacons.
+ */
+static int beacon_answer(struct sockaddr_in *peer, int query_len, double now)
+{
+	int i;
+
+	if(query_len < beacon_len)
+		return 0;
+
+	for(i=0;i<net_count;i++) {
+		if((peer->sin_addr.s_addr & nets[i].mask) == (nets[i].addr & nets[i].mask))
+			break;
+	}
+	if(i == net_count)
+		return 0;
+
+	query_tokens += (now - query_time) * BEACON_QUERY_RATE;
+	if(query_tokens > BEACON_QUERY_BURST)
+		query_tokens = BEACON_QUERY_BURST;
+	query_time = now;
+
+	if(query_tokens < 1)
+		return 0;
+
+	query_tokens--;
+	return 1;
+}
+
+/* the broadcast address of the listen interface may change with its address */
+static void beacon_update(int udp_socket)
+{
+	struct ifreq ifr_brd;
+
+	memset(&ifr_brd, 0, sizeof(ifr_brd));
+	ifr_brd.ifr_addr.sa_family = AF_INET;
+	strncpy(ifr_brd.ifr_name, interface_string, IFNAMSIZ-1);
+	if(ioctl(udp_socket, SIOCGIFBRDADDR, &ifr_brd) == 0)
+		broadcast_addr.sin_addr = ((struct sockaddr_in *) &ifr_brd.ifr_broadaddr)->sin_addr;
+
+	beacon_nets();
+
+	beacon_build();
+}
+
+/* socket notified about changed IPv4 addresses, -1 if not available */
+static int beacon_netlink(void)
+{
+	struct sockaddr_nl addr;
+	int s;
+
+	if((s = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK, NETLINK_ROUTE)) < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_IPV4_IFADDR;
+	if(bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+static double beacon_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
 
 void *beacon_loop(void *ptr) {
-	int i, n, chars_left, ret;
-	int udp_socket;
-	int optval;
+	int ret, optval, maxfd;
+	int udp_socket, query_socket, nl_socket;
+	struct sockaddr_in local_addr, peer_addr;
+	socklen_t peer_len;
+	struct timeval timeout;
 	char buffer[BEACON_LENGTH];
-	char hostname[32];
+	double next = 0, now;
+	fd_set readfds;
 
 	if ((udp_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
 		PRINT_ERROR("Failed to create broadcast socket");
@@ -31,43 +276,83 @@ void *beacon_loop(void *ptr) {
 		PRINT_ERROR("Could not activate SO_BROADCAST\n");
 	}
 
-	/* Connect the socket */
-	if(connect(udp_socket, (struct sockaddr *) &broadcast_addr, sizeof(broadcast_addr)) < 0) {
-		PRINT_ERROR("Failed to connect broadcast socket");
-		return NULL;
+	/* queries have their own port, the beacon port belongs to the clients */
+	if((query_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) >= 0) {
+		memset(&local_addr, 0, sizeof(local_addr));
+		local_addr.sin_family = AF_INET;
+		local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		local_addr.sin_port = htons(BEACON_QUERY_PORT);
+		if(bind(query_socket, (struct sockaddr *) &local_addr, sizeof(local_addr)) < 0) {
+			PRINT_ERROR("Could not bind discovery socket, queries are not answered: %s\n", strerror(errno));
+			close(query_socket);
+			query_socket = -1;
+		}
 	}
 
+	nl_socket = beacon_netlink();
+
+	if(beacon_interval < 0)
+		beacon_interval = 0;
+
+	beacon_build();
+	beacon_nets();
+
 	while(1) {
-		/* Build the beacon */
-		gethostname((char *) &hostname, (size_t)  32);
-		snprintf(buffer, BEACON_LENGTH, "<CANBeacon name=\"%s\" type=\"%s\" description=\"%s\">\n<URL>can://%s:%d</URL>",
-			 hostname, BEACON_TYPE, description, inet_ntoa( saddr.sin_addr ), port);
-
-		for(i=0;i<interface_count;i++) {
-			/* Find \0 in beacon buffer */
-			for(n=0;;n++) {
-				if(buffer[n] == '\0')
-					break;
-			}
-			chars_left = BEACON_LENGTH - n;
+		FD_ZERO(&readfds);
+		maxfd = -1;
+		if(query_socket >= 0) {
+			FD_SET(query_socket, &readfds);
+			maxfd = query_socket;
+		}
+		if(nl_socket >= 0) {
+			FD_SET(nl_socket, &readfds);
+			if(nl_socket > maxfd)
+				maxfd = nl_socket;
+		}
 
-			snprintf(buffer+(n*sizeof(char)), chars_left, "<Bus name=\"%s\"/>", interface_names[i]);
+		now = beacon_now();
+		if(beacon_interval && now >= next) {
+			beacon_hints(now);
+			ret = sendto(udp_socket, beacon, beacon_len, 0,
+				     (struct sockaddr *) &broadcast_addr, sizeof(broadcast_addr));
+			if(ret == -1) {
+				PRINT_ERROR("Error in beacon send()\n");
+			}
+			next = now + beacon_interval;
 		}
-        
-		/* Find \0 in beacon buffer */
-		for(n=0;;n++) {
-			if(buffer[n] == '\0')
-				break;
+
+		timeout.tv_sec = beacon_interval ? (long) (next - now) : 3600;
+		timeout.tv_usec = beacon_interval ? (long) ((next - now - timeout.tv_sec) * 1e6) : 0;
+
+		if(select(maxfd+1, &readfds, NULL, NULL, &timeout) < 0) {
+			if(errno == EINTR)
+				continue;
+			PRINT_ERROR("Error in beacon select()\n");
+			return NULL;
 		}
-		chars_left = BEACON_LENGTH - n;
 
-		snprintf(buffer+(n*sizeof(char)), chars_left, "</CANBeacon>");
+		if(nl_socket >= 0 && FD_ISSET(nl_socket, &readfds)) {
+			while(recv(nl_socket, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+				;
+			beacon_update(udp_socket);
+		}
 
-		ret = send(udp_socket, buffer, strlen(buffer), 0);
-		if(ret == -1) {
-			PRINT_ERROR("Error in beacon send()\n");
+		/* answer queries right away, MSG_TRUNC returns the full length of a padded query */
+		if(query_socket >= 0 && FD_ISSET(query_socket, &readfds)) {
+			peer_len = sizeof(peer_addr);
+			ret = recvfrom(query_socket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT | MSG_TRUNC,
+				       (struct sockaddr *) &peer_addr, &peer_len);
+			if(ret > 0) {
+				buffer[(ret < (int) sizeof(buffer)) ? ret : (int) sizeof(buffer) - 1] = '\0';
+				now = beacon_now();
+				if(!strncmp(buffer, BEACON_QUERY, strlen(BEACON_QUERY))) {
+					beacon_hints(now);
+					if(beacon_answer(&peer_addr, ret, now))
+						sendto(query_socket, beacon, beacon_len, 0,
+						       (struct sockaddr *) &peer_addr, peer_len);
+				}
+			}
 		}
-		sleep(3);
 	}
 
 	return NULL;
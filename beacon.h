@@ -2,5 +2,16 @@
 #define BEACON_LENGTH 2048
 #define BEACON_TYPE "SocketCAN"
 #define BEACON_DESCRIPTION "socketcand"
+#define BEACON_INTERVAL 3 /* default seconds between two broadcasts */
+#define BEACON_QUERY "<CANDiscover/>" /* answered with the beacon right away */
+#define BEACON_QUERY_PORT 42001 /* port the queries are sent to */
+#define BEACON_QUERY_BURST 20 /* answers sent at once */
+#define BEACON_QUERY_RATE 10 /* answers per second after a burst */
+#define BEACON_NETS 16 /* local IPv4 subnets queries are answered from */
+
+#define BEACON_HINTS_INTERVAL 1.0 /* min. seconds between two updates of the load hints */
+
+extern int beacon_interval;
+extern int beacon_load;
 
 void *beacon_loop(void *ptr);
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <net/if.h>
+
+#include <linux/can.h>
+#include <linux/can/isotp.h>
+
+#include "bench.h"
+
+#define BENCH_BUF 16384
+#define BENCH_MSG 8300
+
+static const char *pattern_names[] = { "echo", "send", "receive", "isotp" };
+
+static int server;
+static char rx_buf[BENCH_BUF];
+static int rx_len;
+static uint64_t tx_bytes, rx_bytes;
+
+/* results of a run */
+static uint64_t *samples; /* latencies in ns */
+static int sample_count;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ((uint64_t) ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000 +
+		((uint64_t) ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+int bench_pattern(char *name)
+{
+	int i;
+
+	for(i=0; i<4; i++) {
+		if(!strcmp(name, pattern_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+static int bench_send(char *buf, int len)
+{
+	int i, ret;
+
+	for(i=0; i<len; i+=ret) {
+		ret = send(server, buf + i, len - i, 0);
+		if(ret < 0) {
+			perror("send");
+			return -1;
+		}
+	}
+	tx_bytes += len;
+
+	return 0;
+}
+
+/* move the next complete message from the receive buffer to msg */
+static int bench_take(char *msg)
+{
+	char *start, *stop;
+	int len;
+
+	start = memchr(rx_buf, '<', rx_len);
+	if(!start) {
+		rx_len = 0;
+		return 0;
+	}
+
+	stop = memchr(start, '>', rx_buf + rx_len - start);
+	if(!stop) {
+		/* a message that does not fit is dropped */
+		if(start == rx_buf && rx_len == BENCH_BUF)
+			rx_len = 0;
+		return 0;
+	}
+
+	len = stop - start + 1;
+	if(len >= BENCH_MSG)
+		len = BENCH_MSG - 1;
+	memcpy(msg, start, len);
+	msg[len] = '\0';
+
+	rx_len -= stop + 1 - rx_buf;
+	memmove(rx_buf, stop + 1, rx_len);
+
+	return 1;
+}
+
+static int bench_fill(void)
+{
+	int ret;
+
+	if(rx_len == BENCH_BUF)
+		rx_len = 0;
+
+	ret = read(server, rx_buf + rx_len, BENCH_BUF - rx_len);
+	if(ret <= 0) {
+		fprintf(stderr, "Connection to the server closed\n");
+		return -1;
+	}
+	rx_len += ret;
+	rx_bytes += ret;
+
+	return 0;
+}
+
+/*
+ * Wait for a message starting with prefix, other messages are skipped.
+ * Returns 1 if it was received, 0 on a timeout and -1 on errors.
+ */
+static int bench_wait(char *msg, const char *prefix, int timeout)
+{
+	struct pollfd pfd = { server, POLLIN, 0 };
+	int ret;
+
+	while(1) {
+		while(bench_take(msg)) {
+			if(!strncmp(msg, prefix, strlen(prefix)))
+				return 1;
+			if(!strncmp(msg, "< error", 7))
+				fprintf(stderr, "Server: %s\n", msg);
+		}
+
+		ret = poll(&pfd, 1, timeout);
+		if(ret <= 0)
+			return ret;
+		if(bench_fill() < 0)
+			return -1;
+	}
+}
+
+static int bench_command(char *cmd, char *msg)
+{
+	if(bench_send(cmd, strlen(cmd)) < 0)
+		return -1;
+
+	if(bench_wait(msg, "< ok >", BENCH_TIMEOUT) != 1) {
+		fprintf(stderr, "No response to %s\n", cmd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_echo(int count)
+{
+	char msg[BENCH_MSG];
+	uint64_t start;
+	int i;
+
+	for(i=0; i<count; i++) {
+		start = now_ns();
+		if(bench_send("< echo >", 8) < 0 || bench_wait(msg, "< echo >", BENCH_TIMEOUT) != 1)
+			return -1;
+		samples[sample_count++] = now_ns() - start;
+	}
+
+	return count;
+}
+
+static int bench_flood(int count)
+{
+	char buf[BENCH_BATCH * 48], msg[BENCH_MSG];
+	int i, len = 0;
+
+	for(i=0; i<count; i++) {
+		len += sprintf(buf + len, "< send %03X 8 %02X %02X %02X %02X 00 00 00 00 >",
+			       BENCH_CAN_ID, i >> 24 & 0xFF, i >> 16 & 0xFF, i >> 8 & 0xFF, i & 0xFF);
+		if((i + 1) % BENCH_BATCH == 0 || i == count - 1) {
+			if(bench_send(buf, len) < 0)
+				return -1;
+			len = 0;
+		}
+	}
+
+	/* the echo is answered after all commands before it were processed */
+	if(bench_send("< echo >", 8) < 0 || bench_wait(msg, "< echo >", 10 * BENCH_TIMEOUT) != 1)
+		return -1;
+
+	return count;
+}
+
+static int bench_can_socket(char *dev, int protocol, struct sockaddr_can *addr)
+{
+	struct ifreq ifr;
+	int s;
+
+	if((s = socket(PF_CAN, (protocol == CAN_RAW) ? SOCK_RAW : SOCK_DGRAM, protocol)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+	if(ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
+		perror(dev);
+		close(s);
+		return -1;
+	}
+
+	addr->can_family = AF_CAN;
+	addr->can_ifindex = ifr.ifr_ifindex;
+
+	return s;
+}
+
+/*
+ * Generate frames with a sequence number on the local bus and receive them
+ * from the server, which has to see the same bus. The frames are written as
+ * fast as the local socket takes them.
+ */
+static int bench_receive(char *ldev, int count)
+{
+	struct sockaddr_can addr;
+	struct can_frame frame;
+	struct pollfd pfd[2];
+	char msg[BENCH_MSG];
+	uint64_t *sent;
+	unsigned int seq;
+	int s, i = 0, received = 0, ret;
+
+	if((s = bench_can_socket(ldev, CAN_RAW, &addr)) < 0)
+		return -1;
+	if(bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(s);
+		return -1;
+	}
+
+	sent = calloc(count, sizeof(*sent));
+	if(!sent) {
+		close(s);
+		return -1;
+	}
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = BENCH_CAN_ID;
+	frame.can_dlc = 4;
+
+	pfd[0].fd = server;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s;
+
+	while(received < count) {
+		pfd[1].events = (i < count) ? POLLOUT : 0;
+		ret = poll(pfd, 2, BENCH_TIMEOUT);
+		if(ret <= 0)
+			break;
+
+		if(pfd[1].revents & POLLOUT) {
+			frame.data[0] = i >> 24;
+			frame.data[1] = i >> 16;
+			frame.data[2] = i >> 8;
+			frame.data[3] = i;
+			sent[i] = now_ns();
+			if(write(s, &frame, sizeof(frame)) == sizeof(frame))
+				i++;
+		}
+
+		if(pfd[0].revents & POLLIN) {
+			if(bench_fill() < 0)
+				break;
+			while(bench_take(msg)) {
+				if(strncmp(msg, "< frame 7E1 ", 12))
+					continue;
+				/* the data is the last element */
+				if(sscanf(strrchr(msg, ' ') - 8, "%8x", &seq) != 1 || seq >= (unsigned int) count || !sent[seq])
+					continue;
+				samples[sample_count++] = now_ns() - sent[seq];
+				sent[seq] = 0;
+				received++;
+			}
+		}
+	}
+
+	if(received < count)
+		fprintf(stderr, "%d of %d frames were not received\n", count - received, count);
+
+	free(sent);
+	close(s);
+	return received;
+}
+
+/* send PDUs that a local ISO-TP socket returns to the server */
+static int bench_isotp(char *ldev, int count, int size, char *msg)
+{
+	struct sockaddr_can addr;
+	struct pollfd pfd[2];
+	unsigned char pdu[4096];
+	char *cmd;
+	uint64_t start;
+	int s, i, len, ret, done;
+
+	if((s = bench_can_socket(ldev, CAN_ISOTP, &addr)) < 0)
+		return -1;
+	addr.can_addr.tp.tx_id = BENCH_ISOTP_RX;
+	addr.can_addr.tp.rx_id = BENCH_ISOTP_TX;
+	if(bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(s);
+		return -1;
+	}
+
+	if(bench_command("< isotpmode >", msg) < 0) {
+		close(s);
+		return -1;
+	}
+	/*
+	 * isotpconf is not answered and a failed one closes the connection,
+	 * the echo that follows it is only returned if the channel was set up
+	 */
+	sprintf(msg, "< isotpconf %03X %03X 0 0 0 >", BENCH_ISOTP_TX, BENCH_ISOTP_RX);
+	if(bench_send(msg, strlen(msg)) < 0 || bench_send("< echo >", 8) < 0 ||
+	   bench_wait(msg, "< echo >", BENCH_TIMEOUT) != 1) {
+		fprintf(stderr, "Could not configure the ISO-TP channel\n");
+		close(s);
+		return -1;
+	}
+
+	cmd = malloc(2 * size + 16);
+	if(!cmd) {
+		close(s);
+		return -1;
+	}
+	len = sprintf(cmd, "< sendpdu ");
+	for(i=0; i<size; i++)
+		len += sprintf(cmd + len, "%02X", i & 0xFF);
+	len += sprintf(cmd + len, " >");
+
+	pfd[0].fd = server;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s;
+	pfd[1].events = POLLIN;
+
+	for(i=0; i<count; i++) {
+		start = now_ns();
+		if(bench_send(cmd, len) < 0)
+			break;
+
+		for(done=0; !done; ) {
+			while(!done && bench_take(msg))
+				done = !strncmp(msg, "< pdu ", 6);
+			if(done)
+				break;
+
+			ret = poll(pfd, 2, BENCH_TIMEOUT);
+			if(ret <= 0) {
+				fprintf(stderr, "No PDU received\n");
+				goto out;
+			}
+
+			/* the local socket plays the ECU */
+			if(pfd[1].revents & POLLIN) {
+				ret = read(s, pdu, sizeof(pdu));
+				if(ret > 0 && write(s, pdu, ret) != ret)
+					perror("write");
+			}
+
+			if((pfd[0].revents & POLLIN) && bench_fill() < 0)
+				goto out;
+		}
+
+		samples[sample_count++] = now_ns() - start;
+	}
+
+out:
+	free(cmd);
+	close(s);
+	return sample_count;
+}
+
+static int compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(int p)
+{
+	int i;
+
+	if(!sample_count)
+		return 0;
+
+	i = ((uint64_t) sample_count * p + 99) / 100;
+	if(i > 0)
+		i--;
+
+	return samples[i] / 1000.0;
+}
+
+/*
+ * Drive the server with a pattern and print the rate, the throughput of the
+ * TCP connection, the CPU usage of the client and the latency percentiles.
+ */
+int bench_run(int socket, int pattern, char *rdev, char *ldev, int count, int size, int json)
+{
+	char msg[BENCH_MSG];
+	uint64_t start, elapsed, cpu;
+	double seconds;
+	int done;
+
+	server = socket;
+	samples = calloc(count, sizeof(*samples));
+	if(!samples)
+		return -1;
+
+	if(bench_wait(msg, "< hi >", BENCH_TIMEOUT) != 1) {
+		fprintf(stderr, "No greeting from the server\n");
+		goto fail;
+	}
+	sprintf(msg, "< open %s >", rdev);
+	if(bench_command(msg, msg) < 0)
+		goto fail;
+	if(pattern == BENCH_RECEIVE && bench_command("< rawmode >", msg) < 0)
+		goto fail;
+
+	tx_bytes = rx_bytes = 0;
+	cpu = cpu_ns();
+	start = now_ns();
+
+	switch(pattern) {
+	case BENCH_ECHO:
+		done = bench_echo(count);
+		break;
+	case BENCH_SEND:
+		done = bench_flood(count);
+		break;
+	case BENCH_RECEIVE:
+		done = bench_receive(ldev, count);
+		break;
+	default:
+		done = bench_isotp(ldev, count, size, msg);
+		break;
+	}
+
+	elapsed = now_ns() - start;
+	cpu = cpu_ns() - cpu;
+
+	if(done <= 0)
+		goto fail;
+
+	seconds = elapsed / 1e9;
+	qsort(samples, sample_count, sizeof(*samples), compare);
+
+	if(json) {
+		printf("{\"pattern\": \"%s\", \"count\": %d, \"seconds\": %.6f, \"rate\": %.1f, "
+		       "\"tx_bytes_per_s\": %.0f, \"rx_bytes_per_s\": %.0f, \"cpu_percent\": %.1f",
+		       pattern_names[pattern], done, seconds, done / seconds,
+		       tx_bytes / seconds, rx_bytes / seconds, cpu * 100.0 / elapsed);
+		if(sample_count)
+			printf(", \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+			       percentile(50), percentile(90), percentile(99), percentile(100));
+		printf("}\n");
+	} else {
+		printf("%s: %d in %.3f s, %.1f per s\n", pattern_names[pattern], done, seconds, done / seconds);
+		printf("TCP: %.0f bytes/s sent, %.0f bytes/s received, client CPU %.1f%%\n",
+		       tx_bytes / seconds, rx_bytes / seconds, cpu * 100.0 / elapsed);
+		if(sample_count)
+			printf("latency us: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+			       percentile(50), percentile(90), percentile(99), percentile(100));
+	}
+
+	free(samples);
+	return 0;
+
+fail:
+	free(samples);
+	return -1;
+}
@@ -0,0 +1,16 @@
+/* load patterns of 'socketcandcl --bench' */
+#define BENCH_ECHO 0 /* round trips of '< echo >' */
+#define BENCH_SEND 1 /* flood of '< send >' commands in BCM mode */
+#define BENCH_RECEIVE 2 /* frames of the local bus received in RAW mode */
+#define BENCH_ISOTP 3 /* PDUs echoed by a local ISO-TP socket */
+
+#define BENCH_COUNT 10000 /* default number of round trips, frames or PDUs */
+#define BENCH_PDU_SIZE 64 /* default length of the ISO-TP PDUs */
+#define BENCH_BATCH 64 /* send commands written at once */
+#define BENCH_TIMEOUT 2000 /* ms to wait for a response */
+#define BENCH_CAN_ID 0x7E1 /* frames generated on the local bus */
+#define BENCH_ISOTP_TX 0x7E2 /* ISO-TP channel of the server */
+#define BENCH_ISOTP_RX 0x7EA
+
+int bench_pattern(char *name);
+int bench_run(int socket, int pattern, char *rdev, char *ldev, int count, int size, int json);
@@ -0,0 +1,329 @@
+#include "config.h"
+#include "socketcand.h"
+#include "statistics.h"
+#include "busload.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+/* bitrates used for interfaces that report no bit timing, e.g. vcan */
+int busload_bitrate = 0;
+int busload_dbitrate = 0;
+
+/* RAW socket watching all frames of an opened bus */
+static struct {
+	int socket; /* -1 if the load of the bus is not known */
+	__u32 bitrate;
+	__u32 dbitrate;
+	uint64_t busy[BUSLOAD_RING]; /* ns the bus was busy in each slot */
+} monitors[MAX_OPEN_BUSSES];
+
+static int monitor_count = 0;
+static uint64_t current_slot, first_slot;
+
+static const unsigned char fd_dlc[65] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11,
+	12, 12, 12, 12, 13, 13, 13, 13, 13, 13, 13, 13, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15
+};
+
+/* append count bits of value, most significant bit first */
+static int put_bits(unsigned char *bits, int pos, uint32_t value, int count)
+{
+	while(count--)
+		bits[pos++] = (value >> count) & 1;
+
+	return pos;
+}
+
+/*
+ * Count the stuff bits the transmitter inserts after five bits of the same
+ * value. before is set to the number of stuff bits in front of bit split.
+ */
+static int stuff_bits(unsigned char *bits, int len, int split, int *before)
+{
+	int i, run = 1, stuff = 0, last = bits[0];
+
+	*before = 0;
+
+	for(i=1;i<len;i++) {
+		if(bits[i] != last) {
+			last = bits[i];
+			run = 1;
+			continue;
+		}
+
+		if(++run == 5) {
+			/* the stuff bit starts a new run with the inverted value */
+			stuff++;
+			if(i < split)
+				(*before)++;
+			last = !last;
+			run = 1;
+		}
+	}
+
+	return stuff;
+}
+
+static uint16_t crc15(unsigned char *bits, int len)
+{
+	uint16_t crc = 0;
+	int i;
+
+	for(i=0;i<len;i++) {
+		if(bits[i] ^ ((crc >> 14) & 1))
+			crc = ((crc << 1) ^ 0x4599) & 0x7FFF;
+		else
+			crc = (crc << 1) & 0x7FFF;
+	}
+
+	return crc;
+}
+
+/*
+ * Time in ns a frame occupies the bus including stuff bits, the end of
+ * frame and the interframe space. The stuff bits of classic CAN frames are
+ * counted exactly. CAN FD frames use the fixed stuff bits of the CRC field
+ * and the data bitrate for the data phase if the bitrate is switched.
+ */
+static uint64_t frame_time(struct canfd_frame *cf, int fd, __u32 bitrate, __u32 dbitrate)
+{
+	unsigned char bits[1 + 32 + 8 + 8 * CANFD_MAX_DLEN + 15];
+	int n = 0, arbitration, stuff, before, crclen, fixed;
+	uint64_t nominal, data;
+	int eff = cf->can_id & CAN_EFF_FLAG;
+	int rtr = !fd && (cf->can_id & CAN_RTR_FLAG);
+	int len = (cf->len > (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN)) ? 0 : cf->len;
+
+	bits[n++] = 0; /* SOF */
+
+	if(eff) {
+		n = put_bits(bits, n, (cf->can_id & CAN_EFF_MASK) >> 18, 11);
+		n = put_bits(bits, n, 3, 2); /* SRR, IDE */
+		n = put_bits(bits, n, cf->can_id & 0x3FFFF, 18);
+		n = put_bits(bits, n, rtr, 1); /* RTR or RRS */
+	} else {
+		n = put_bits(bits, n, cf->can_id & CAN_SFF_MASK, 11);
+		n = put_bits(bits, n, rtr, 1); /* RTR or RRS */
+		n = put_bits(bits, n, 0, 1); /* IDE */
+	}
+
+	if(!fd) {
+		n = put_bits(bits, n, 0, eff ? 2 : 1); /* r1, r0 */
+		n = put_bits(bits, n, len, 4);
+		if(!rtr) {
+			for(fixed=0;fixed<len;fixed++)
+				n = put_bits(bits, n, cf->data[fixed], 8);
+		}
+		n = put_bits(bits, n, crc15(bits, n), 15);
+
+		stuff = stuff_bits(bits, n, n, &before);
+
+		/* CRC delimiter, ACK slot and delimiter, EOF, interframe space */
+		return (uint64_t) (n + stuff + 13) * 1000000000 / bitrate;
+	}
+
+	/* FDF, res, BRS - the data phase starts with ESI */
+	n = put_bits(bits, n, 2, 2);
+	n = put_bits(bits, n, (cf->flags & CANFD_BRS) ? 1 : 0, 1);
+	arbitration = n;
+
+	n = put_bits(bits, n, (cf->flags & CANFD_ESI) ? 1 : 0, 1);
+	n = put_bits(bits, n, fd_dlc[len], 4);
+	for(fixed=0;fixed<len;fixed++)
+		n = put_bits(bits, n, cf->data[fixed], 8);
+
+	stuff = stuff_bits(bits, n, arbitration, &before);
+
+	/* stuff count and CRC with a fixed stuff bit in front of every four bits */
+	crclen = (len > 16) ? 21 : 17;
+	fixed = 4 + crclen;
+	fixed += 1 + fixed / 4;
+
+	if(!(cf->flags & CANFD_BRS))
+		dbitrate = bitrate;
+
+	/* ACK slot and delimiter, EOF, interframe space */
+	nominal = arbitration + before + 12;
+	/* the data phase ends with the CRC delimiter */
+	data = (n - arbitration) + (stuff - before) + fixed + 1;
+
+	return nominal * 1000000000 / bitrate + data * 1000000000 / dbitrate;
+}
+
+/* absolute number of the slot of the current time */
+static uint64_t busload_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000) / BUSLOAD_SLOT_MS;
+}
+
+/* move to the slot of the current time and clear the slots skipped */
+static void busload_tick(void)
+{
+	uint64_t slot = busload_now();
+	int i;
+
+	if(slot - current_slot >= BUSLOAD_RING)
+		current_slot = slot - BUSLOAD_RING;
+
+	for(current_slot++; current_slot <= slot; current_slot++) {
+		for(i=0;i<monitor_count;i++)
+			monitors[i].busy[current_slot % BUSLOAD_RING] = 0;
+	}
+	current_slot = slot;
+}
+
+/* open a monitor socket for every opened bus with a known bitrate */
+int busload_open(void)
+{
+	const int on = 1;
+	struct sockaddr_can addr;
+	int i, s;
+
+	if(monitor_count)
+		return 0;
+
+	for(i=0;i<bus_count;i++) {
+		memset(&monitors[i], 0, sizeof(monitors[i]));
+		monitors[i].socket = -1;
+		monitors[i].bitrate = busload_bitrate;
+		monitors[i].dbitrate = busload_dbitrate;
+
+		if(!busses[i].ifindex)
+			busses[i].ifindex = if_nametoindex(busses[i].name);
+		statistics_bitrate(busses[i].ifindex, &monitors[i].bitrate, &monitors[i].dbitrate);
+
+		if(!monitors[i].bitrate) {
+			PRINT_VERBOSE("bitrate of %s unknown, no bus load\n", busses[i].name);
+			continue;
+		}
+		if(!monitors[i].dbitrate)
+			monitors[i].dbitrate = monitors[i].bitrate;
+
+		if((s = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW)) < 0) {
+			PRINT_ERROR("Error while creating RAW socket %s\n", strerror(errno));
+			continue;
+		}
+
+		/* CAN FD frames are received if the kernel supports them */
+		setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on));
+
+		memset(&addr, 0, sizeof(addr));
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = busses[i].ifindex;
+		if(bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			PRINT_ERROR("Error while binding RAW socket %s\n", strerror(errno));
+			close(s);
+			continue;
+		}
+
+		monitors[i].socket = s;
+	}
+
+	monitor_count = bus_count;
+	current_slot = first_slot = busload_now();
+
+	return 0;
+}
+
+void busload_close(void)
+{
+	int i;
+
+	for(i=0;i<monitor_count;i++) {
+		if(monitors[i].socket >= 0)
+			close(monitors[i].socket);
+	}
+
+	monitor_count = 0;
+}
+
+int busload_fds(fd_set *readfds, int maxfd)
+{
+	int i;
+
+	for(i=0;i<monitor_count;i++) {
+		if(monitors[i].socket < 0)
+			continue;
+		FD_SET(monitors[i].socket, readfds);
+		if(monitors[i].socket > maxfd)
+			maxfd = monitors[i].socket;
+	}
+
+	return maxfd;
+}
+
+/* add the time of all received frames to the current slot */
+void busload_process(fd_set *readfds)
+{
+	struct canfd_frame cf;
+	int i, ret;
+
+	if(!monitor_count)
+		return;
+
+	busload_tick();
+
+	for(i=0;i<monitor_count;i++) {
+		if(monitors[i].socket < 0 || !FD_ISSET(monitors[i].socket, readfds))
+			continue;
+
+		while((ret = read(monitors[i].socket, &cf, sizeof(cf))) > 0) {
+			if(cf.can_id & CAN_ERR_FLAG)
+				continue;
+			monitors[i].busy[current_slot % BUSLOAD_RING] +=
+				frame_time(&cf, ret == CANFD_MTU, monitors[i].bitrate, monitors[i].dbitrate);
+		}
+	}
+}
+
+/*
+ * Send '< busload load_100ms load_1s load_10s >' with the load of the bus
+ * in percent over the last complete slots.
+ */
+void busload_report(int bus)
+{
+	static const int windows[] = { 1, 10, BUSLOAD_SLOTS };
+	char buf[128];
+	uint64_t busy;
+	int len, w, k, i;
+
+	if(bus >= monitor_count || monitors[bus].socket < 0)
+		return;
+
+	busload_tick();
+
+	len = bus_prefix(buf, bus);
+	len += sprintf(buf + len, "busload");
+
+	for(w=0;w<3;w++) {
+		/* shorter windows until the monitor has been running long enough */
+		k = windows[w];
+		if((uint64_t) k > current_slot - first_slot)
+			k = current_slot - first_slot;
+
+		for(i=1, busy=0;i<=k;i++)
+			busy += monitors[bus].busy[(current_slot - i) % BUSLOAD_RING];
+
+		len += sprintf(buf + len, " %.1f",
+			       k ? busy * 100.0 / ((uint64_t) k * BUSLOAD_SLOT_MS * 1000000) : 0.0);
+	}
+
+	sprintf(buf + len, " >");
+	send(client_socket, buf, strlen(buf), 0);
+}
@@ -0,0 +1,14 @@
+#include <sys/select.h>
+
+#define BUSLOAD_SLOT_MS 100 /* resolution of the sliding windows */
+#define BUSLOAD_SLOTS 100 /* slots of the longest window (10 s) */
+#define BUSLOAD_RING (BUSLOAD_SLOTS + 1) /* the longest window and the current slot */
+
+extern int busload_bitrate;
+extern int busload_dbitrate;
+
+int busload_open(void);
+void busload_close(void);
+int busload_fds(fd_set *readfds, int maxfd);
+void busload_process(fd_set *readfds);
+void busload_report(int bus);
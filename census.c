@@ -0,0 +1,375 @@
+#include "config.h"
+#include "socketcand.h"
+#include "census.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <net/if.h>
+
+#include <linux/can/raw.h>
+
+/*
+ * The identifiers seen on a bus. The slots only hold the index + 1 of an
+ * entry, the entries themselves are allocated for the identifiers that
+ * were actually seen.
+ */
+struct census_table {
+	int socket;
+	__u16 sff[CENSUS_SFF_SLOTS];
+	__u16 eff[CENSUS_EFF_SLOTS];
+	struct census_entry *entries;
+	int used;
+	int size;
+	int eff_used;
+	__u32 lost; /* frames of extended identifiers that did not fit */
+	__u32 lost_reported;
+};
+
+static struct census_table *tables[MAX_OPEN_BUSSES];
+static int table_count = 0;
+static int census_timer = -1;
+
+/*
+ * Find the entry of a CAN ID. Standard identifiers are indexed directly,
+ * extended ones are placed in an open addressing table with linear probing
+ * that is filled up to three quarters. The entry of a new identifier is
+ * added to the entries of the table. Returns NULL if there is no room.
+ */
+static struct census_entry *census_lookup(struct census_table *t, canid_t can_id)
+{
+	struct census_entry *e;
+	__u16 *slot;
+	__u32 i;
+
+	if(!(can_id & CAN_EFF_FLAG)) {
+		slot = &t->sff[can_id & CAN_SFF_MASK];
+		if(*slot)
+			return &t->entries[*slot - 1];
+	} else {
+		i = ((can_id & CAN_EFF_MASK) * 2654435761u) >> (32 - CENSUS_EFF_BITS);
+
+		while(t->eff[i]) {
+			if(t->entries[t->eff[i] - 1].can_id == can_id)
+				return &t->entries[t->eff[i] - 1];
+			i = (i + 1) & (CENSUS_EFF_SLOTS - 1);
+		}
+
+		if(t->eff_used >= CENSUS_EFF_SLOTS / 4 * 3)
+			return NULL;
+		slot = &t->eff[i];
+	}
+
+	if(t->used == t->size) {
+		e = realloc(t->entries, (t->size ? t->size * 2 : CENSUS_ENTRIES_MIN) * sizeof(*e));
+		if(!e)
+			return NULL;
+		t->entries = e;
+		t->size = t->size ? t->size * 2 : CENSUS_ENTRIES_MIN;
+	}
+
+	e = &t->entries[t->used++];
+	memset(e, 0, sizeof(*e));
+	e->can_id = can_id;
+	*slot = t->used;
+	if(can_id & CAN_EFF_FLAG)
+		t->eff_used++;
+
+	return e;
+}
+
+static void census_update(struct census_table *t, struct canfd_frame *cf, uint64_t now)
+{
+	struct census_entry *e;
+	uint64_t period, mean, deviation, jitter;
+
+	/* remote frames are counted with their identifier */
+	if(!(cf->can_id & CAN_EFF_FLAG))
+		cf->can_id &= CAN_SFF_MASK;
+	else
+		cf->can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+
+	e = census_lookup(t, cf->can_id);
+	if(!e) {
+		t->lost++;
+		return;
+	}
+
+	e->len = cf->len;
+
+	if(!e->count++) {
+		e->first = e->last = now;
+		return;
+	}
+
+	period = now - e->last;
+	e->last = now;
+
+	if(period / 1000 > UINT32_MAX)
+		period = (uint64_t) UINT32_MAX * 1000;
+	if(e->count == 2 || period / 1000 < e->min)
+		e->min = period / 1000;
+	if(period / 1000 > e->max)
+		e->max = period / 1000;
+
+	/* smoothed deviation from the mean period like the RTP interarrival jitter */
+	mean = (e->last - e->first) / (e->count - 1);
+	deviation = (period > mean) ? period - mean : mean - period;
+	jitter = e->jitter;
+	if(deviation > jitter)
+		jitter += (deviation - jitter) >> CENSUS_JITTER_GAIN;
+	else
+		jitter -= (jitter - deviation) >> CENSUS_JITTER_GAIN;
+	e->jitter = (jitter > UINT32_MAX) ? UINT32_MAX : jitter;
+}
+
+/*
+ * Send '< census can_id count dlc mean min max jitter last >' for every
+ * identifier of a bus. The periods are in microseconds. With changed only
+ * the entries that received frames since they were last sent are included
+ * and the lost frames only if their number changed.
+ */
+static void census_send(int bus, int changed)
+{
+	struct census_table *t = tables[bus];
+	struct census_entry *e;
+	char buf[MAXLEN];
+	uint64_t mean;
+	unsigned int i;
+	int len;
+	__u16 slot;
+
+	for(i=0;i<CENSUS_SFF_SLOTS+CENSUS_EFF_SLOTS;i++) {
+		slot = (i < CENSUS_SFF_SLOTS) ? t->sff[i] : t->eff[i - CENSUS_SFF_SLOTS];
+		if(!slot)
+			continue;
+		e = &t->entries[slot - 1];
+
+		if(changed && e->count == e->reported)
+			continue;
+		e->reported = e->count;
+
+		mean = (e->count > 1) ? (e->last - e->first) / (e->count - 1) : 0;
+
+		len = bus_prefix(buf, bus);
+		if(e->can_id & CAN_EFF_FLAG)
+			len += sprintf(buf + len, "census %08X", e->can_id & CAN_EFF_MASK);
+		else
+			len += sprintf(buf + len, "census %03X", e->can_id);
+
+		sprintf(buf + len, " %u %u %llu %llu %llu %llu %llu.%06llu >",
+			e->count, e->len,
+			(unsigned long long) (mean / 1000),
+			(unsigned long long) e->min,
+			(unsigned long long) e->max,
+			(unsigned long long) (e->jitter / 1000),
+			(unsigned long long) (e->last / 1000000000),
+			(unsigned long long) (e->last % 1000000000 / 1000));
+
+		send(client_socket, buf, strlen(buf), 0);
+	}
+
+	if(t->lost && (!changed || t->lost != t->lost_reported)) {
+		t->lost_reported = t->lost;
+		len = bus_prefix(buf, bus);
+		sprintf(buf + len, "census lost %u >", t->lost);
+		send(client_socket, buf, strlen(buf), 0);
+	}
+}
+
+static int census_start(int ival)
+{
+	const int on = 1;
+	struct sockaddr_can addr;
+	struct itimerspec its;
+	int i, s;
+
+	if(!table_count) {
+		for(i=0;i<bus_count;i++) {
+			tables[i] = calloc(1, sizeof(struct census_table));
+			if(!tables[i]) {
+				PRINT_ERROR("could not allocate census table\n");
+				census_stop();
+				return -1;
+			}
+			tables[i]->socket = -1;
+			table_count = i + 1;
+
+			if((s = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW)) < 0) {
+				PRINT_ERROR("Error while creating RAW socket %s\n", strerror(errno));
+				census_stop();
+				return -1;
+			}
+			tables[i]->socket = s;
+
+			setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on));
+			setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+			if(!busses[i].ifindex)
+				busses[i].ifindex = if_nametoindex(busses[i].name);
+
+			memset(&addr, 0, sizeof(addr));
+			addr.can_family = AF_CAN;
+			addr.can_ifindex = busses[i].ifindex;
+			if(bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+				PRINT_ERROR("Error while binding RAW socket %s\n", strerror(errno));
+				census_stop();
+				return -1;
+			}
+		}
+	}
+
+	if(census_timer < 0) {
+		if(!ival)
+			return 0;
+
+		census_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(census_timer < 0) {
+			PRINT_ERROR("could not create census timer: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	its.it_value.tv_sec = ival / 1000;
+	its.it_value.tv_nsec = (ival % 1000) * 1000000;
+	its.it_interval = its.it_value;
+
+	if(timerfd_settime(census_timer, 0, &its, NULL) < 0) {
+		PRINT_ERROR("could not set census timer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void census_stop(void)
+{
+	int i;
+
+	for(i=0;i<table_count;i++) {
+		if(tables[i]->socket >= 0)
+			close(tables[i]->socket);
+		free(tables[i]->entries);
+		free(tables[i]);
+		tables[i] = NULL;
+	}
+	table_count = 0;
+
+	if(census_timer >= 0) {
+		close(census_timer);
+		census_timer = -1;
+	}
+}
+
+/*
+ * Parse '< census >', '< census start [ival] >' and '< census stop >'.
+ * Returns -1 on a syntax error.
+ */
+int census_command(char *buf)
+{
+	int i, ival = 0;
+
+	if(!strcmp("< census >", buf)) {
+		if(!table_count) {
+			strcpy(buf, "< error census not started >");
+			send(client_socket, buf, strlen(buf), 0);
+			return 0;
+		}
+		for(i=0;i<table_count;i++)
+			census_send(i, 0);
+		return 0;
+	}
+
+	if(!strcmp("< census stop >", buf)) {
+		census_stop();
+		return 0;
+	}
+
+	if(!strncmp("< census start ", buf, 15)) {
+		if(strcmp("< census start >", buf) && sscanf(buf, "< %*s %*s %u >", &ival) != 1) {
+			METRIC_INC(parse_errors);
+			PRINT_ERROR("Syntax error in census command\n");
+			return -1;
+		}
+		return census_start(ival);
+	}
+
+	METRIC_INC(parse_errors);
+	PRINT_ERROR("Syntax error in census command\n");
+	return -1;
+}
+
+int census_fds(fd_set *readfds, int maxfd)
+{
+	int i;
+
+	for(i=0;i<table_count;i++) {
+		FD_SET(tables[i]->socket, readfds);
+		if(tables[i]->socket > maxfd)
+			maxfd = tables[i]->socket;
+	}
+
+	if(census_timer >= 0) {
+		FD_SET(census_timer, readfds);
+		if(census_timer > maxfd)
+			maxfd = census_timer;
+	}
+
+	return maxfd;
+}
+
+/* count the received frames and send the changed entries when the timer expired */
+void census_process(fd_set *readfds)
+{
+	struct canfd_frame frame;
+	struct msghdr msg;
+	struct iovec iov;
+	struct timespec ts;
+	char ctrlmsg[CMSG_SPACE(sizeof(struct timespec))];
+	struct cmsghdr *cmsg;
+	uint64_t expirations;
+	int i;
+
+	for(i=0;i<table_count;i++) {
+		if(!FD_ISSET(tables[i]->socket, readfds))
+			continue;
+
+		while(1) {
+			iov.iov_base = &frame;
+			iov.iov_len = sizeof(frame);
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = &ctrlmsg;
+			msg.msg_controllen = sizeof(ctrlmsg);
+
+			if(recvmsg(tables[i]->socket, &msg, 0) <= 0)
+				break;
+
+			if(frame.can_id & CAN_ERR_FLAG)
+				continue;
+
+			ts.tv_sec = 0;
+			ts.tv_nsec = 0;
+			for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+					memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			}
+
+			census_update(tables[i], &frame, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+		}
+	}
+
+	if(census_timer >= 0 && FD_ISSET(census_timer, readfds) &&
+	   read(census_timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+		for(i=0;i<table_count;i++)
+			census_send(i, 1);
+	}
+}
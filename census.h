@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <sys/select.h>
+#include <linux/can.h>
+
+#define CENSUS_SFF_SLOTS (CAN_SFF_MASK + 1) /* one entry per standard identifier */
+#define CENSUS_EFF_BITS 12
+#define CENSUS_EFF_SLOTS (1 << CENSUS_EFF_BITS) /* hashed extended identifiers */
+#define CENSUS_JITTER_GAIN 4 /* the jitter follows a new period with 1/16 */
+#define CENSUS_ENTRIES_MIN 64 /* entries allocated for the first identifiers of a bus */
+
+/* traffic of a single CAN ID, timestamps in ns, periods in us (48 bytes) */
+struct census_entry {
+	uint64_t first;
+	uint64_t last;
+	canid_t can_id;
+	__u32 count;
+	__u32 reported; /* count when the entry was last sent */
+	__u32 min;
+	__u32 max;
+	__u32 jitter; /* in ns, saturated at about 4 s */
+	__u8 len;
+};
+
+int census_command(char *buf);
+void census_stop(void);
+int census_fds(fd_set *readfds, int maxfd);
+void census_process(fd_set *readfds);
@@ -0,0 +1,319 @@
+#include "config.h"
+#include "socketcand.h"
+#include "flash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+
+/* UDS service identifiers */
+#define SID_REQUEST_DOWNLOAD 0x34
+#define SID_TRANSFER_DATA 0x36
+#define SID_REQUEST_TRANSFER_EXIT 0x37
+#define SID_NEGATIVE_RESPONSE 0x7F
+#define NRC_RESPONSE_PENDING 0x78
+#define POSITIVE_RESPONSE(sid) ((sid) + 0x40)
+
+/* directory with images that may be flashed by name, NULL disables it */
+char *flash_dir = NULL;
+
+void flash_init(struct flash_job *job)
+{
+	memset(job, 0, sizeof(*job));
+	job->fd = -1;
+}
+
+/* forget the job including an image that was already sent by the client */
+void flash_reset(struct flash_job *job)
+{
+	if(job->fd >= 0)
+		close(job->fd);
+	free(job->image);
+	flash_init(job);
+}
+
+/* collect the image sent by the client with '< flashdata >' */
+int flash_append(struct flash_job *job, unsigned char *data, int len)
+{
+	unsigned char *image;
+
+	if(job->state != FLASH_IDLE)
+		return -1;
+
+	/* the collected part is dropped, the client has to start again */
+	if(job->image_len + len > FLASH_MAX_IMAGE) {
+		PRINT_ERROR("Flash image exceeds %d bytes\n", FLASH_MAX_IMAGE);
+		flash_reset(job);
+		return -1;
+	}
+
+	image = realloc(job->image, job->image_len + len);
+	if(!image) {
+		PRINT_ERROR("Could not allocate flash image\n");
+		flash_reset(job);
+		return -1;
+	}
+
+	memcpy(image + job->image_len, data, len);
+	job->image = image;
+	job->image_len += len;
+
+	return 0;
+}
+
+/*
+ * Check that an opened file is a regular file below flash_dir. The path is
+ * taken from the descriptor, so symbolic links in flash_dir that point
+ * outside of it are refused.
+ */
+static int flash_contained(int fd, struct stat *st)
+{
+	char dir[PATH_MAX], link[64], path[PATH_MAX];
+	size_t dir_len;
+	ssize_t len;
+
+	if(!S_ISREG(st->st_mode) || !realpath(flash_dir, dir))
+		return 0;
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, path, sizeof(path) - 1);
+	if(len < 0)
+		return 0;
+	path[len] = '\0';
+
+	dir_len = strlen(dir);
+	return !strncmp(path, dir, dir_len) && path[dir_len] == '/';
+}
+
+/*
+ * Start the download of the collected image or of a file in flash_dir to
+ * the given memory address. max_pdu limits the size of the TransferData
+ * requests. Returns -1 if there is nothing to flash.
+ */
+int flash_start(struct flash_job *job, unsigned long address, char *file, size_t max_pdu)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if(job->state != FLASH_IDLE)
+		return -1;
+
+	if(file) {
+		if(!flash_dir) {
+			PRINT_ERROR("Flashing of local files is disabled\n");
+			return -1;
+		}
+
+		/* only files inside of flash_dir may be used */
+		if(file[0] == '/' || strstr(file, "..")) {
+			PRINT_ERROR("Invalid flash file '%s'\n", file);
+			return -1;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", flash_dir, file);
+		job->fd = open(path, O_RDONLY);
+		if(job->fd < 0 || fstat(job->fd, &st) < 0) {
+			PRINT_ERROR("Could not open flash file '%s': %s\n", path, strerror(errno));
+			flash_reset(job);
+			return -1;
+		}
+
+		if(!flash_contained(job->fd, &st)) {
+			PRINT_ERROR("Flash file '%s' is not a file in %s\n", file, flash_dir);
+			flash_reset(job);
+			return -1;
+		}
+
+		/* RequestDownload has four bytes for the memory size */
+		if((unsigned long long) st.st_size > FLASH_MAX_FILE) {
+			PRINT_ERROR("Flash file '%s' exceeds %lu bytes\n", file, FLASH_MAX_FILE);
+			flash_reset(job);
+			return -1;
+		}
+
+		free(job->image);
+		job->image = NULL;
+		job->image_len = st.st_size;
+	}
+
+	if(!job->image_len || max_pdu < 3) {
+		flash_reset(job);
+		return -1;
+	}
+
+	job->address = address;
+	job->sent = 0;
+	job->seq = 1;
+	job->max_block = max_pdu - 2;
+	job->status = FLASH_OK;
+	job->state = FLASH_REQUEST_DOWNLOAD;
+
+	return 0;
+}
+
+static void flash_deadline(struct flash_job *job, int seconds)
+{
+	clock_gettime(CLOCK_MONOTONIC, &job->deadline);
+	job->deadline.tv_sec += seconds;
+}
+
+static size_t flash_block(struct flash_job *job)
+{
+	size_t left = job->image_len - job->sent;
+
+	return (left > job->max_block) ? job->max_block : left;
+}
+
+/* size of the next request in bytes */
+size_t flash_request_size(struct flash_job *job)
+{
+	switch(job->state) {
+	case FLASH_REQUEST_DOWNLOAD:
+		return 11;
+	case FLASH_TRANSFER_DATA:
+		return flash_block(job) + 2;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Build the next request of the job into pdu, which has to hold
+ * flash_request_size() bytes. Returns the length or -1 if the image could
+ * not be read. The timeout of the response starts with flash_sent().
+ */
+int flash_request(struct flash_job *job, unsigned char *pdu)
+{
+	int i;
+
+	job->sending = 1;
+
+	switch(job->state) {
+	case FLASH_REQUEST_DOWNLOAD:
+		/* no compression/encryption, 4 bytes memory address and size */
+		pdu[0] = SID_REQUEST_DOWNLOAD;
+		pdu[1] = 0x00;
+		pdu[2] = 0x44;
+		for(i=0;i<4;i++) {
+			pdu[3 + i] = job->address >> (24 - 8*i);
+			pdu[7 + i] = job->image_len >> (24 - 8*i);
+		}
+		return 11;
+
+	case FLASH_TRANSFER_DATA:
+		job->block_len = flash_block(job);
+		pdu[0] = SID_TRANSFER_DATA;
+		pdu[1] = job->seq;
+		if(job->fd >= 0) {
+			if(pread(job->fd, pdu + 2, job->block_len, job->sent) != (ssize_t) job->block_len)
+				return -1;
+		} else {
+			memcpy(pdu + 2, job->image + job->sent, job->block_len);
+		}
+		return job->block_len + 2;
+
+	default:
+		pdu[0] = SID_REQUEST_TRANSFER_EXIT;
+		return 1;
+	}
+}
+
+/* the request left the queue of the channel, the ECU has P2 to respond */
+void flash_sent(struct flash_job *job)
+{
+	job->sending = 0;
+	flash_deadline(job, FLASH_P2_TIMEOUT);
+}
+
+/* end the job, the image is consumed */
+void flash_finish(struct flash_job *job, int status)
+{
+	if(job->fd >= 0)
+		close(job->fd);
+	job->fd = -1;
+	free(job->image);
+	job->image = NULL;
+	job->image_len = 0;
+	job->status = status;
+	job->state = FLASH_IDLE;
+}
+
+/* service identifier of the pending request */
+static unsigned char flash_sid(struct flash_job *job)
+{
+	switch(job->state) {
+	case FLASH_REQUEST_DOWNLOAD:
+		return SID_REQUEST_DOWNLOAD;
+	case FLASH_TRANSFER_DATA:
+		return SID_TRANSFER_DATA;
+	default:
+		return SID_REQUEST_TRANSFER_EXIT;
+	}
+}
+
+/* process a response of the ECU, see FLASH_SEND, FLASH_WAIT and FLASH_DONE */
+int flash_response(struct flash_job *job, unsigned char *pdu, int len)
+{
+	int i, lfid;
+	size_t block;
+
+	if(len < 1)
+		return FLASH_WAIT;
+
+	/* negative responses to other requests are ignored */
+	if(pdu[0] == SID_NEGATIVE_RESPONSE && len >= 3 && pdu[1] == flash_sid(job)) {
+		/* the ECU needs more time, e.g. for erasing the memory */
+		if(pdu[2] == NRC_RESPONSE_PENDING) {
+			flash_deadline(job, FLASH_P2X_TIMEOUT);
+			return FLASH_WAIT;
+		}
+
+		job->nrc = pdu[2];
+		flash_finish(job, FLASH_NEGATIVE_RESPONSE);
+		return FLASH_DONE;
+	}
+
+	switch(job->state) {
+	case FLASH_REQUEST_DOWNLOAD:
+		if(pdu[0] != POSITIVE_RESPONSE(SID_REQUEST_DOWNLOAD) || len < 2)
+			break;
+
+		/* maxNumberOfBlockLength includes the SID and the sequence counter */
+		lfid = pdu[1] >> 4;
+		if(len < 2 + lfid)
+			break;
+		for(i=0, block=0; i<lfid; i++)
+			block = (block << 8) | pdu[2 + i];
+		if(block > 2 && block - 2 < job->max_block)
+			job->max_block = block - 2;
+
+		job->state = FLASH_TRANSFER_DATA;
+		return FLASH_SEND;
+
+	case FLASH_TRANSFER_DATA:
+		if(pdu[0] != POSITIVE_RESPONSE(SID_TRANSFER_DATA) || len < 2 || pdu[1] != job->seq)
+			break;
+
+		job->sent += job->block_len;
+		job->seq++;
+		if(job->sent == job->image_len)
+			job->state = FLASH_TRANSFER_EXIT;
+		return FLASH_SEND;
+
+	case FLASH_TRANSFER_EXIT:
+		if(pdu[0] != POSITIVE_RESPONSE(SID_REQUEST_TRANSFER_EXIT))
+			break;
+
+		flash_finish(job, FLASH_OK);
+		return FLASH_DONE;
+	}
+
+	/* ignore unrelated responses */
+	return FLASH_WAIT;
+}
@@ -0,0 +1,55 @@
+#include <stddef.h>
+#include <time.h>
+
+/* states of a download job */
+#define FLASH_IDLE 0
+#define FLASH_REQUEST_DOWNLOAD 1
+#define FLASH_TRANSFER_DATA 2
+#define FLASH_TRANSFER_EXIT 3
+
+/* results reported with '< flashdone channel status >' */
+#define FLASH_OK 0
+#define FLASH_NEGATIVE_RESPONSE 1
+#define FLASH_TIMEOUT 2
+#define FLASH_TX_ERROR 3
+#define FLASH_ABORTED 4
+#define FLASH_IMAGE_ERROR 5
+
+/* return values of flash_response() */
+#define FLASH_SEND 0 /* send the next request */
+#define FLASH_WAIT 1 /* the ECU needs more time */
+#define FLASH_DONE 2 /* the job has finished, see status */
+
+#define FLASH_P2_TIMEOUT 2 /* seconds to wait for a response */
+#define FLASH_P2X_TIMEOUT 5 /* seconds to wait after 'response pending' */
+#define FLASH_MAX_IMAGE (16 << 20) /* bytes a client may send with flashdata */
+#define FLASH_MAX_FILE 0xFFFFFFFFUL /* bytes of a file, memorySize of RequestDownload */
+
+/* a UDS download (RequestDownload, TransferData, RequestTransferExit) */
+struct flash_job {
+	int state;
+	int status;
+	unsigned char nrc; /* negative response code if status is FLASH_NEGATIVE_RESPONSE */
+	int fd; /* image file or -1 if the image was sent by the client */
+	unsigned char *image;
+	size_t image_len;
+	unsigned long address;
+	size_t sent; /* bytes acknowledged by the ECU */
+	size_t block_len; /* bytes of the current TransferData request */
+	size_t max_block; /* data bytes per TransferData request */
+	unsigned char seq; /* blockSequenceCounter */
+	int sending; /* the request is not sent completely, deadline is not set */
+	struct timespec deadline;
+};
+
+extern char *flash_dir;
+
+void flash_init(struct flash_job *job);
+void flash_reset(struct flash_job *job);
+int flash_append(struct flash_job *job, unsigned char *data, int len);
+int flash_start(struct flash_job *job, unsigned long address, char *file, size_t max_pdu);
+size_t flash_request_size(struct flash_job *job);
+int flash_request(struct flash_job *job, unsigned char *pdu);
+void flash_sent(struct flash_job *job);
+int flash_response(struct flash_job *job, unsigned char *pdu, int len);
+void flash_finish(struct flash_job *job, int status);
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include "config.h"
+#include "socketcand.h"
+#include "handoff.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+/* unix socket a new daemon connects to for the listening sockets, NULL if none */
+char *handoff_path = NULL;
+
+static int handoff_socket = -1;
+
+/* control message buffer that is aligned for struct cmsghdr */
+union handoff_control {
+	char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+	struct cmsghdr align;
+};
+
+/*
+ * Take the listening sockets passed with systemd socket activation
+ * (LISTEN_PID and LISTEN_FDS). Returns the number of sockets stored in fds.
+ */
+int handoff_inherit(int *fds, int max)
+{
+	char *pid = getenv("LISTEN_PID");
+	char *count = getenv("LISTEN_FDS");
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int i, n, on, found = 0;
+
+	if(!pid || !count || atoi(pid) != getpid())
+		return 0;
+
+	n = atoi(count);
+
+	/* the sockets are not meant for processes started by the daemon */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	if(n > max) {
+		PRINT_ERROR("Only the first %d of %d inherited sockets are used\n", max, n);
+		n = max;
+	}
+
+	for(i=0;i<n;i++) {
+		on = 0;
+		len = sizeof(on);
+		if(getsockopt(LISTEN_FDS_START + i, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) < 0 || !on) {
+			PRINT_ERROR("Inherited file descriptor %d is no listening socket\n", LISTEN_FDS_START + i);
+			continue;
+		}
+		fds[found++] = LISTEN_FDS_START + i;
+	}
+
+	/*
+	 * Only the port of the first socket is taken, the announced address is
+	 * the one of the interface as the socket may be bound to a wildcard.
+	 */
+	if(found) {
+		len = sizeof(addr);
+		if(getsockname(fds[0], (struct sockaddr *) &addr, &len) == 0) {
+			if(addr.ss_family == AF_INET)
+				port = ntohs(((struct sockaddr_in *) &addr)->sin_port);
+			else if(addr.ss_family == AF_INET6)
+				port = ntohs(((struct sockaddr_in6 *) &addr)->sin6_port);
+		}
+	}
+
+	PRINT_VERBOSE("Inherited %d listening sockets\n", found);
+
+	return found;
+}
+
+static void handoff_address(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, handoff_path, sizeof(addr->sun_path) - 1);
+}
+
+/*
+ * Ask a running daemon for its listening sockets. The addresses come with
+ * them, so neither the interface nor the sockets have to be set up again.
+ * Returns the number of sockets stored in fds, 0 if there is no daemon.
+ */
+int handoff_receive(int *fds, int max)
+{
+	struct sockaddr_un addr;
+	struct handoff_info info;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union handoff_control control;
+	struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+	int received[HANDOFF_MAX_LISTENERS];
+	int s, i, n = 0;
+	char ack = 1;
+
+	if(!handoff_path)
+		return 0;
+
+	if((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		PRINT_ERROR("Could not create handoff socket: %s\n", strerror(errno));
+		return 0;
+	}
+
+	handoff_address(&addr);
+	if(connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		PRINT_VERBOSE("No daemon to take over from at %s\n", handoff_path);
+		close(s);
+		return 0;
+	}
+
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &info;
+	iov.iov_len = sizeof(info);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	i = recvmsg(s, &msg, 0);
+
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(received, CMSG_DATA(cmsg), n * sizeof(int));
+		}
+	}
+
+	if(i != sizeof(info) || info.version != HANDOFF_VERSION || info.count != n ||
+	   n == 0 || n > max || (msg.msg_flags & MSG_CTRUNC)) {
+		PRINT_ERROR("Handoff from the running daemon failed\n");
+		for(i=0;i<n;i++)
+			close(received[i]);
+		close(s);
+		return 0;
+	}
+
+	if(send(s, &ack, 1, MSG_NOSIGNAL) != 1) {
+		PRINT_ERROR("Could not confirm the handoff: %s\n", strerror(errno));
+		for(i=0;i<n;i++)
+			close(received[i]);
+		close(s);
+		return 0;
+	}
+
+	/* the old daemon closes the connection after giving its ports free */
+	recv(s, &ack, 1, 0);
+	close(s);
+
+	memcpy(fds, received, n * sizeof(int));
+	saddr = info.saddr;
+	broadcast_addr = info.broadcast_addr;
+	port = ntohs(saddr.sin_port);
+
+	PRINT_VERBOSE("Took over %d listening sockets from the running daemon\n", n);
+
+	return n;
+}
+
+/* listen for a new daemon that takes over the listening sockets */
+int handoff_open(void)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int s, ret;
+
+	if(!handoff_path)
+		return -1;
+
+	if((s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		PRINT_ERROR("Could not create handoff socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* the socket of a predecessor is replaced */
+	handoff_address(&addr);
+	unlink(addr.sun_path);
+
+	/* only the owner may take the listening sockets */
+	mask = umask(077);
+	ret = bind(s, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+
+	if(ret < 0 || listen(s, 1) < 0) {
+		PRINT_ERROR("Could not listen on handoff socket %s: %s\n", handoff_path, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	handoff_socket = s;
+	return s;
+}
+
+int handoff_fd(void)
+{
+	return handoff_socket;
+}
+
+/*
+ * Pass the listening sockets to a new daemon that connected to the handoff
+ * socket. Returns 1 if the new daemon took them over. The sockets and the
+ * metrics port are closed then and this daemon should exit; the processes
+ * of the connected clients keep running.
+ */
+int handoff_serve(int *fds, int count)
+{
+	struct handoff_info info;
+	struct ucred cred;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union handoff_control control;
+	struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+	socklen_t len = sizeof(cred);
+	int c, i;
+	char ack;
+
+	if((c = accept(handoff_socket, NULL, NULL)) < 0)
+		return 0;
+
+	if(getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+	   (cred.uid != 0 && cred.uid != geteuid())) {
+		PRINT_ERROR("Refused handoff to a process of another user\n");
+		close(c);
+		return 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.version = HANDOFF_VERSION;
+	info.count = count;
+	info.saddr = saddr;
+	info.broadcast_addr = broadcast_addr;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = &info;
+	iov.iov_len = sizeof(info);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+	setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if(sendmsg(c, &msg, MSG_NOSIGNAL) != sizeof(info) || recv(c, &ack, 1, 0) != 1) {
+		PRINT_ERROR("Handoff to pid %d failed\n", cred.pid);
+		close(c);
+		return 0;
+	}
+
+	PRINT_INFO("Listening sockets handed over to pid %d\n", cred.pid);
+
+	for(i=0;i<count;i++)
+		close(fds[i]);
+	metrics_stop();
+
+	/* the new daemon replaces the socket file */
+	close(handoff_socket);
+	handoff_socket = -1;
+	close(c);
+
+	return 1;
+}
+
+/*
+ * Start the binary again, e.g. after an upgrade. The new daemon takes the
+ * listening sockets through the handoff socket.
+ */
+void handoff_start(char **argv)
+{
+	pid_t pid;
+	long fd, max;
+
+	if(handoff_socket < 0) {
+		PRINT_ERROR("No handoff socket, the daemon is not restarted\n");
+		return;
+	}
+
+	PRINT_INFO("Starting %s to take over the listening sockets\n", argv[0]);
+
+	pid = fork();
+	if(pid < 0) {
+		PRINT_ERROR("Could not start the new daemon: %s\n", strerror(errno));
+		return;
+	}
+
+	if(pid)
+		return;
+
+	/* the new daemon has to bind the ports of the threads itself */
+	max = sysconf(_SC_OPEN_MAX);
+	for(fd=3;fd<max;fd++)
+		close(fd);
+
+	execvp(argv[0], argv);
+	PRINT_ERROR("Could not execute %s: %s\n", argv[0], strerror(errno));
+	_exit(1);
+}
+
+/* the processes of the clients do not serve the handoff socket */
+void handoff_close(void)
+{
+	if(handoff_socket >= 0) {
+		close(handoff_socket);
+		handoff_socket = -1;
+	}
+}
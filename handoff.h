@@ -0,0 +1,24 @@
+#include <netinet/in.h>
+
+#define HANDOFF_MAX_LISTENERS 8 /* listening sockets taken from systemd or a predecessor */
+#define HANDOFF_VERSION 1 /* layout of struct handoff_info */
+#define HANDOFF_TIMEOUT 5 /* seconds to wait for the other daemon */
+#define LISTEN_FDS_START 3 /* first socket passed with socket activation */
+
+/* sent together with the listening sockets to the new daemon */
+struct handoff_info {
+	int version;
+	int count;
+	struct sockaddr_in saddr;
+	struct sockaddr_in broadcast_addr;
+};
+
+extern char *handoff_path;
+
+int handoff_inherit(int *fds, int max);
+int handoff_receive(int *fds, int max);
+int handoff_open(void);
+int handoff_fd(void);
+int handoff_serve(int *fds, int count);
+void handoff_start(char **argv);
+void handoff_close(void);
@@ -0,0 +1,240 @@
+#include "config.h"
+#include "socketcand.h"
+#include "timestamp.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+/* record the acknowledgement of forwarded frames by the client */
+int latency_ack = 0;
+
+/* frames sent to the client in the order of their acknowledgements */
+static struct {
+	struct timespec rx_ts;
+	int bus;
+} ack_queue[LATENCY_ACK_QUEUE];
+static int ack_head = 0, ack_count = 0;
+
+static int latency_bucket(uint64_t ns)
+{
+	int exp, sub;
+
+	if(ns < (1ULL << LATENCY_MIN_EXP))
+		return 0;
+
+	exp = 63 - __builtin_clzll(ns);
+	if(exp > LATENCY_MAX_EXP)
+		return LATENCY_BUCKETS - 1;
+
+	sub = (ns >> (exp - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+	return ((exp - LATENCY_MIN_EXP) << LATENCY_SUB_BITS) + sub + 1;
+}
+
+/* upper bound of a bucket in nanoseconds */
+static uint64_t latency_upper(int bucket)
+{
+	int exp, sub;
+
+	if(bucket == 0)
+		return 1ULL << LATENCY_MIN_EXP;
+
+	if(bucket >= LATENCY_BUCKETS - 1)
+		return UINT64_MAX;
+
+	exp = ((bucket - 1) >> LATENCY_SUB_BITS) + LATENCY_MIN_EXP;
+	sub = (bucket - 1) & ((1 << LATENCY_SUB_BITS) - 1);
+	return (1ULL << exp) + ((uint64_t) (sub + 1) << (exp - LATENCY_SUB_BITS));
+}
+
+static void latency_record(int bus, int kind, struct timespec *from, struct timespec *to)
+{
+	int64_t ns;
+
+	if(!metrics || bus < 0 || busses[bus].iface >= METRICS_BUSSES)
+		return;
+
+	ns = (int64_t) (to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+	if(ns < 0)
+		ns = 0;
+
+	metrics->latency[busses[bus].iface][kind][latency_bucket(ns)]++;
+}
+
+/*
+ * Parse '< latency send|ack >'. With 'ack' the time until the client
+ * acknowledged a frame on TCP level is recorded in addition.
+ */
+int latency_command(char *buf)
+{
+	char mode[8];
+	int flags;
+
+	if(sscanf(buf, "< %*s %7s >", mode) != 1 ||
+	   (strcmp(mode, "send") && strcmp(mode, "ack"))) {
+		METRIC_INC(parse_errors);
+		PRINT_ERROR("Syntax error in latency command\n");
+		return -1;
+	}
+
+	latency_ack = !strcmp(mode, "ack");
+	ack_count = 0;
+
+	/* the acknowledgement is only requested per frame with sendmsg() */
+	flags = latency_ack ? (SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY) : 0;
+	if(setsockopt(client_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+		PRINT_ERROR("Could not enable TCP timestamps: %s\n", strerror(errno));
+		latency_ack = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Send a received frame to the client and record the time since its
+ * reception. Latencies are only recorded with software timestamps because
+ * hardware timestamps are taken from another clock.
+ */
+int latency_send(int bus, char *buf, int len, struct timespec *rx_ts)
+{
+	struct timespec now;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(__u32))];
+	int ret, slot;
+
+	if(timestamp_source != TIMESTAMP_SOFTWARE || !rx_ts->tv_sec)
+		return send(client_socket, buf, len, 0);
+
+	if(!latency_ack || ack_count == LATENCY_ACK_QUEUE) {
+		ret = send(client_socket, buf, len, 0);
+	} else {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SO_TIMESTAMPING;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(__u32));
+		*((__u32 *) CMSG_DATA(cmsg)) = SOF_TIMESTAMPING_TX_ACK;
+
+		ret = sendmsg(client_socket, &msg, 0);
+		if(ret >= 0) {
+			slot = (ack_head + ack_count) % LATENCY_ACK_QUEUE;
+			ack_queue[slot].rx_ts = *rx_ts;
+			ack_queue[slot].bus = bus;
+			ack_count++;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	latency_record(bus, LATENCY_SEND, rx_ts, &now);
+
+	return ret;
+}
+
+/*
+ * Read the acknowledgement timestamps from the error queue of the client
+ * socket. TCP acknowledges in order, so they belong to the oldest frames.
+ */
+void latency_errqueue(int socket)
+{
+	char control[512];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct scm_timestamping stamps;
+	struct sock_extended_err *err;
+	int have_ts, is_ack;
+
+	while(1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if(recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		have_ts = is_ack = 0;
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+				memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+				have_ts = 1;
+			} else if(cmsg->cmsg_level != SOL_SOCKET) {
+				err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+				is_ack = (err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+					  err->ee_info == SCM_TSTAMP_ACK);
+			}
+		}
+
+		if(!have_ts || !is_ack || !ack_count)
+			continue;
+
+		latency_record(ack_queue[ack_head].bus, LATENCY_ACK,
+			       &ack_queue[ack_head].rx_ts, &stamps.ts[0]);
+		ack_head = (ack_head + 1) % LATENCY_ACK_QUEUE;
+		ack_count--;
+	}
+}
+
+/*
+ * Send the histograms of all connections to the client as
+ * '< latency pid bus kind count p50 p90 p99 max [upper:count]* >' with
+ * the percentiles given as upper bounds of the buckets in microseconds.
+ */
+void latency_report(void)
+{
+	static const char *kinds[] = { "send", "ack" };
+	static const int percentiles[] = { 50, 90, 99, 100 };
+	struct metrics_slot *slot;
+	char buf[MAXLEN];
+	uint64_t count, sum;
+	uint32_t *hist;
+	int i, bus, kind, b, p, len;
+
+	for(i=0;i<METRICS_SLOTS;i++) {
+		slot = metrics_slot(i);
+		if(!slot)
+			continue;
+
+		for(bus=0;bus<interface_count && bus<METRICS_BUSSES;bus++) {
+			for(kind=0;kind<LATENCY_KINDS;kind++) {
+				hist = slot->latency[bus][kind];
+
+				for(b=0, count=0;b<LATENCY_BUCKETS;b++)
+					count += hist[b];
+				if(!count)
+					continue;
+
+				len = sprintf(buf, "< latency %d %s %s %llu", slot->pid,
+					      interface_names[bus], kinds[kind], (unsigned long long) count);
+
+				for(p=0, b=0, sum=0;p<4;p++) {
+					while(b < LATENCY_BUCKETS && sum + hist[b] < (count * percentiles[p] + 99) / 100)
+						sum += hist[b++];
+					len += sprintf(buf + len, " %llu", (unsigned long long) (latency_upper(b) / 1000));
+				}
+
+				for(b=0;b<LATENCY_BUCKETS;b++) {
+					if(hist[b])
+						len += sprintf(buf + len, " %llu:%u",
+							       (unsigned long long) (latency_upper(b) / 1000), hist[b]);
+				}
+
+				sprintf(buf + len, " >");
+				send(client_socket, buf, strlen(buf), 0);
+			}
+		}
+	}
+}
@@ -0,0 +1,26 @@
+#include <stdint.h>
+#include <time.h>
+
+/* kinds of latency recorded per bus */
+#define LATENCY_SEND 0 /* reception by the kernel until handed to the client socket */
+#define LATENCY_ACK 1 /* reception by the kernel until acknowledged by the client */
+#define LATENCY_KINDS 2
+
+/*
+ * Log-linear histogram of nanoseconds: every power of two from 2^10 to
+ * 2^34 ns is split into 2^LATENCY_SUB_BITS linear buckets. Bucket 0 holds
+ * shorter values, the last bucket longer ones.
+ */
+#define LATENCY_SUB_BITS 2
+#define LATENCY_MIN_EXP 10
+#define LATENCY_MAX_EXP 34
+#define LATENCY_BUCKETS (((LATENCY_MAX_EXP - LATENCY_MIN_EXP + 1) << LATENCY_SUB_BITS) + 2)
+
+#define LATENCY_ACK_QUEUE 1024 /* frames waiting for their acknowledgement */
+
+extern int latency_ack;
+
+int latency_command(char *buf);
+int latency_send(int bus, char *buf, int len, struct timespec *rx_ts);
+void latency_errqueue(int socket);
+void latency_report(void);
@@ -0,0 +1,213 @@
+#include "config.h"
+#include "socketcand.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <sys/eventfd.h>
+
+/*
+ * Bounded ring of records with a sequence number per slot. A producer owns
+ * a slot after advancing head with a compare and swap and publishes it by
+ * setting the sequence to its position + 1. The writer frees it again by
+ * setting the sequence to position + LOG_RING.
+ */
+static struct {
+	uint32_t seq;
+	int priority;
+	char text[LOG_LEN];
+} ring[LOG_RING];
+
+static uint32_t head, tail;
+static int draining = 0;
+static pid_t writer_pid = 0; /* process the writer thread was started in */
+static int write_sync = 0; /* no writer thread, records are written by the producer */
+static int wakeup_fd = -1; /* signalled for every published record */
+
+static uint64_t log_now(void)
+{
+	struct timespec now;
+
+	/* the coarse clock is read without a system call */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* write all published records, only one thread at a time */
+static void log_drain(void)
+{
+	uint32_t pos;
+	int i;
+
+	if(__sync_lock_test_and_set(&draining, 1))
+		return;
+
+	for(pos = tail; ; pos++) {
+		i = pos & (LOG_RING - 1);
+		if(__atomic_load_n(&ring[i].seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+
+		if(daemon_flag)
+			syslog(ring[i].priority, "%s", ring[i].text);
+		else
+			fputs(ring[i].text, (ring[i].priority <= LOG_ERR) ? stderr : stdout);
+
+		__atomic_store_n(&ring[i].seq, pos + LOG_RING, __ATOMIC_RELEASE);
+	}
+
+	tail = pos;
+	__sync_lock_release(&draining);
+}
+
+/* sleeps until a record was published, a connection without errors never wakes it */
+static void *log_writer(void *arg)
+{
+	uint64_t count;
+
+	(void) arg;
+
+	while(1) {
+		if(read(wakeup_fd, &count, sizeof(count)) < 0)
+			continue;
+		log_drain();
+	}
+
+	return NULL;
+}
+
+/*
+ * Threads do not survive fork(), so every connection starts its own writer
+ * with its first record. The ring inherited from the daemon is reset.
+ */
+static void log_start(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int i;
+
+	writer_pid = getpid();
+
+	head = tail = 0;
+	for(i=0;i<LOG_RING;i++)
+		ring[i].seq = i;
+
+	/* the descriptor of the daemon belongs to its writer */
+	if(wakeup_fd >= 0)
+		close(wakeup_fd);
+
+	wakeup_fd = eventfd(0, EFD_CLOEXEC);
+	if(wakeup_fd < 0) {
+		write_sync = 1;
+	} else {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		write_sync = (pthread_create(&thread, &attr, &log_writer, NULL) != 0);
+		pthread_attr_destroy(&attr);
+	}
+
+	atexit(log_flush);
+}
+
+/* format a record into a free slot, returns -1 if the ring is full */
+static int log_push(int priority, const char *format, va_list ap)
+{
+	uint32_t pos, seq;
+	int i;
+
+	pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	while(1) {
+		i = pos & (LOG_RING - 1);
+		seq = __atomic_load_n(&ring[i].seq, __ATOMIC_ACQUIRE);
+
+		if(seq == pos) {
+			if(__atomic_compare_exchange_n(&head, &pos, pos + 1, 0,
+						       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if((int32_t) (seq - pos) < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+	}
+
+	ring[i].priority = priority;
+	vsnprintf(ring[i].text, LOG_LEN, format, ap);
+	__atomic_store_n(&ring[i].seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int log_printf(int priority, const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	ret = log_push(priority, format, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+void log_ratelimited(struct log_limit *limit, int priority, const char *format, ...)
+{
+	uint64_t now = log_now();
+	uint32_t refill;
+	va_list ap;
+	int ret;
+
+	refill = (now - limit->stamp) / LOG_TOKEN_MS;
+	if(refill) {
+		limit->stamp += (uint64_t) refill * LOG_TOKEN_MS;
+		if(refill >= LOG_BURST - limit->tokens) {
+			limit->tokens = LOG_BURST;
+			limit->stamp = now;
+		} else {
+			limit->tokens += refill;
+		}
+	}
+
+	if(!limit->tokens) {
+		limit->suppressed++;
+		return;
+	}
+	limit->tokens--;
+
+	if(writer_pid != getpid())
+		log_start();
+
+	va_start(ap, format);
+	ret = log_push(priority, format, ap);
+	va_end(ap);
+
+	if(ret < 0) {
+		limit->suppressed++;
+	} else if(limit->suppressed) {
+		if(log_printf(priority, "%u similar messages suppressed\n", limit->suppressed) == 0)
+			limit->suppressed = 0;
+	}
+
+	if(write_sync) {
+		log_drain();
+	} else if(ret == 0) {
+		uint64_t one = 1;
+
+		/* records of one wakeup are written together */
+		if(write(wakeup_fd, &one, sizeof(one)) < 0)
+			log_drain();
+	}
+}
+
+/* write the pending records of this process, e.g. before it exits */
+void log_flush(void)
+{
+	if(writer_pid == getpid())
+		log_drain();
+}
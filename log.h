@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <syslog.h>
+
+#define LOG_RING 256 /* records waiting for the writer, a power of two */
+#define LOG_LEN 256 /* max. length of a record */
+#define LOG_BURST 10 /* messages a call site may log at once */
+#define LOG_TOKEN_MS 1000 /* a call site regains one message per interval */
+
+/* token bucket of a single call site */
+struct log_limit {
+	uint64_t stamp; /* time of the last refill in ms */
+	uint32_t tokens;
+	uint32_t suppressed; /* messages dropped since the last one logged */
+};
+
+/*
+ * Log an error from a path that runs per frame or command. Each call site
+ * may log LOG_BURST messages and then one per LOG_TOKEN_MS, the others are
+ * counted and reported with the next message that passes. The message is
+ * only formatted into a ring buffer, a thread of the connection writes it
+ * to syslog or stderr so that forwarding never waits for the log.
+ */
+#define PRINT_ERROR_RATELIMITED(...) do { static struct log_limit log_limit_; log_ratelimited(&log_limit_, LOG_ERR, __VA_ARGS__); } while(0)
+
+void log_ratelimited(struct log_limit *limit, int priority, const char *format, ...)
+	__attribute__ ((format (printf, 3, 4)));
+void log_flush(void);
@@ -0,0 +1,329 @@
+#include "config.h"
+#include "socketcand.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* counters of all connections, shared between the daemon and its children */
+struct metrics_block {
+	struct metrics_slot retired; /* sum of the closed connections */
+	struct metrics_slot slots[METRICS_SLOTS];
+};
+
+static struct metrics_block *block = NULL;
+
+struct metrics_slot *metrics = NULL;
+
+/* port of the HTTP listener, 0 disables it */
+int metrics_port = 0;
+
+/* listening socket of the metrics thread, -1 if it does not run */
+static int metrics_socket = -1;
+
+static const char *state_names[] = {
+	"nobus", "bcm", "raw", "shutdown", "control", "isotp"
+};
+
+/* map the counter block before the first connection is forked */
+int metrics_init(void)
+{
+	block = mmap(NULL, sizeof(*block), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(block == MAP_FAILED) {
+		PRINT_ERROR("Could not map metrics: %s\n", strerror(errno));
+		block = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* take a free slot for the connection handled by this process */
+void metrics_attach(void)
+{
+	int i;
+	pid_t pid = getpid();
+
+	if(!block)
+		return;
+
+	for(i=0;i<METRICS_SLOTS;i++) {
+		if(__sync_bool_compare_and_swap(&block->slots[i].pid, 0, pid)) {
+			metrics = &block->slots[i];
+			return;
+		}
+	}
+
+	PRINT_ERROR("No free metrics slot, connection is not counted\n");
+}
+
+/*
+ * Called by the daemon for a terminated connection. The counters are added
+ * to the retired ones so that the totals never decrease and the slot is
+ * cleared before it is given free.
+ */
+void metrics_release(pid_t pid)
+{
+	struct metrics_slot *slot, *retired;
+	int i, j;
+
+	if(!block)
+		return;
+
+	retired = &block->retired;
+
+	for(i=0;i<METRICS_SLOTS;i++) {
+		slot = &block->slots[i];
+		if(slot->pid != pid)
+			continue;
+
+		retired->commands += slot->commands;
+		retired->parse_errors += slot->parse_errors;
+		retired->short_writes += slot->short_writes;
+		retired->bcm_drops += slot->bcm_drops;
+		for(j=0;j<METRICS_BUSSES;j++) {
+			retired->frames_rx[j] += slot->frames_rx[j];
+			retired->frames_tx[j] += slot->frames_tx[j];
+			retired->drops[j] += slot->drops[j];
+		}
+
+		memset((char *) slot + sizeof(slot->pid), 0, sizeof(*slot) - sizeof(slot->pid));
+		__sync_synchronize();
+		slot->pid = 0;
+		return;
+	}
+}
+
+/* number of connections with a slot, -1 without metrics */
+int metrics_connections(void)
+{
+	int i, n = 0;
+
+	if(!block)
+		return -1;
+
+	for(i=0;i<METRICS_SLOTS;i++) {
+		if(block->slots[i].pid)
+			n++;
+	}
+
+	return n;
+}
+
+/* slot i if it belongs to a connection, NULL otherwise */
+struct metrics_slot *metrics_slot(int i)
+{
+	if(!block || i < 0 || i >= METRICS_SLOTS || !block->slots[i].pid)
+		return NULL;
+
+	return &block->slots[i];
+}
+
+/* sum up a counter over the retired and the active connections */
+#define METRICS_SUM(sum, field) do { \
+	sum = block->retired.field; \
+	for(i=0;i<METRICS_SLOTS;i++) \
+		if(block->slots[i].pid) \
+			sum += block->slots[i].field; \
+	} while(0)
+
+/* print a counter with one value per configured bus */
+static void metrics_bus_counter(FILE *f, const char *name, const char *help, int offset)
+{
+	uint64_t sum;
+	int i, bus;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+
+	for(bus=0;bus<interface_count && bus<METRICS_BUSSES;bus++) {
+		sum = ((uint64_t *) ((char *) &block->retired + offset))[bus];
+		for(i=0;i<METRICS_SLOTS;i++) {
+			if(block->slots[i].pid)
+				sum += ((uint64_t *) ((char *) &block->slots[i] + offset))[bus];
+		}
+		fprintf(f, "%s{bus=\"%s\"} %llu\n", name, interface_names[bus], (unsigned long long) sum);
+	}
+}
+
+/*
+ * Print the metrics of all connections in the Prometheus text format into
+ * a newly allocated buffer. Returns NULL if metrics are not available.
+ */
+char *metrics_format(size_t *len)
+{
+	struct metrics_slot *slot;
+	char *text = NULL;
+	uint64_t sum;
+	int i, j, connections = 0;
+	FILE *f;
+
+	if(!block)
+		return NULL;
+
+	f = open_memstream(&text, len);
+	if(!f)
+		return NULL;
+
+	for(i=0;i<METRICS_SLOTS;i++) {
+		if(block->slots[i].pid)
+			connections++;
+	}
+
+	fprintf(f, "# HELP socketcand_connections Connected clients.\n"
+		"# TYPE socketcand_connections gauge\n"
+		"socketcand_connections %d\n", connections);
+
+	METRICS_SUM(sum, commands);
+	fprintf(f, "# HELP socketcand_commands_total Commands received from clients.\n"
+		"# TYPE socketcand_commands_total counter\n"
+		"socketcand_commands_total %llu\n", (unsigned long long) sum);
+
+	METRICS_SUM(sum, parse_errors);
+	fprintf(f, "# HELP socketcand_parse_errors_total Unknown or malformed commands.\n"
+		"# TYPE socketcand_parse_errors_total counter\n"
+		"socketcand_parse_errors_total %llu\n", (unsigned long long) sum);
+
+	METRICS_SUM(sum, short_writes);
+	fprintf(f, "# HELP socketcand_short_writes_total Messages not completely written to clients.\n"
+		"# TYPE socketcand_short_writes_total counter\n"
+		"socketcand_short_writes_total %llu\n", (unsigned long long) sum);
+
+	metrics_bus_counter(f, "socketcand_frames_received_total", "Frames received from the bus.",
+			    offsetof(struct metrics_slot, frames_rx));
+	metrics_bus_counter(f, "socketcand_frames_sent_total", "Frames sent to the bus.",
+			    offsetof(struct metrics_slot, frames_tx));
+	metrics_bus_counter(f, "socketcand_drops_total", "Frames dropped in the receive queues.",
+			    offsetof(struct metrics_slot, drops));
+
+	METRICS_SUM(sum, bcm_drops);
+	fprintf(f, "# HELP socketcand_bcm_drops_total Frames dropped in the receive queues of BCM sockets serving all busses.\n"
+		"# TYPE socketcand_bcm_drops_total counter\n"
+		"socketcand_bcm_drops_total %llu\n", (unsigned long long) sum);
+
+	fprintf(f, "# HELP socketcand_connection_info Mode of a connection.\n"
+		"# TYPE socketcand_connection_info gauge\n");
+	for(i=0;i<METRICS_SLOTS;i++) {
+		slot = &block->slots[i];
+		if(slot->pid && slot->state >= 0 && slot->state <= STATE_ISOTP)
+			fprintf(f, "socketcand_connection_info{pid=\"%d\",mode=\"%s\"} 1\n",
+				slot->pid, state_names[slot->state]);
+	}
+
+	fprintf(f, "# HELP socketcand_connection_commands_total Commands received from a connection.\n"
+		"# TYPE socketcand_connection_commands_total counter\n");
+	for(i=0;i<METRICS_SLOTS;i++) {
+		slot = &block->slots[i];
+		if(slot->pid)
+			fprintf(f, "socketcand_connection_commands_total{pid=\"%d\"} %llu\n",
+				slot->pid, (unsigned long long) slot->commands);
+	}
+
+	fprintf(f, "# HELP socketcand_connection_frames_received_total Frames forwarded to a connection.\n"
+		"# TYPE socketcand_connection_frames_received_total counter\n");
+	for(i=0;i<METRICS_SLOTS;i++) {
+		slot = &block->slots[i];
+		if(!slot->pid)
+			continue;
+		for(j=0, sum=0;j<METRICS_BUSSES;j++)
+			sum += slot->frames_rx[j];
+		fprintf(f, "socketcand_connection_frames_received_total{pid=\"%d\"} %llu\n",
+			slot->pid, (unsigned long long) sum);
+	}
+
+	fprintf(f, "# HELP socketcand_connection_tx_queue PDUs waiting for transmission.\n"
+		"# TYPE socketcand_connection_tx_queue gauge\n");
+	for(i=0;i<METRICS_SLOTS;i++) {
+		slot = &block->slots[i];
+		if(slot->pid)
+			fprintf(f, "socketcand_connection_tx_queue{pid=\"%d\"} %llu\n",
+				slot->pid, (unsigned long long) slot->tx_queue);
+	}
+
+	fclose(f);
+	return text;
+}
+
+/* serve the metrics to every HTTP request on metrics_port */
+void *metrics_loop(void *ptr)
+{
+	struct sockaddr_in addr;
+	char request[1024], head[128];
+	char *text;
+	size_t len;
+	int sm, c;
+	const int on = 1;
+	struct timeval timeout = { METRICS_TIMEOUT_MS / 1000, (METRICS_TIMEOUT_MS % 1000) * 1000 };
+
+	(void) ptr;
+
+	if((sm = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+		PRINT_ERROR("Could not create metrics socket\n");
+		return NULL;
+	}
+
+	setsockopt(sm, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	addr = saddr;
+	addr.sin_port = htons(metrics_port);
+	if(bind(sm, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sm, 3) < 0) {
+		PRINT_ERROR("Could not listen for metrics on port %d: %s\n", metrics_port, strerror(errno));
+		close(sm);
+		return NULL;
+	}
+
+	metrics_socket = sm;
+
+	while(1) {
+		c = accept(sm, NULL, NULL);
+		if(c < 0) {
+			/* the port was given free with metrics_stop() */
+			if(metrics_socket < 0) {
+				close(sm);
+				return NULL;
+			}
+			continue;
+		}
+
+		/* a client that sends or reads nothing must not block the next scrapes */
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		/* every request is answered with the metrics */
+		if(recv(c, request, sizeof(request), 0) > 0 && (text = metrics_format(&len))) {
+			snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+				 "Content-Type: text/plain; version=0.0.4\r\n"
+				 "Content-Length: %zu\r\n\r\n", len);
+			send(c, head, strlen(head), MSG_MORE | MSG_NOSIGNAL);
+			send(c, text, len, MSG_NOSIGNAL);
+			free(text);
+		}
+		close(c);
+	}
+
+	return NULL;
+}
+
+/*
+ * Give the metrics port free, e.g. for a daemon taking over the listening
+ * sockets. The socket is only shut down here as the thread may wait in
+ * accept() on it.
+ */
+void metrics_stop(void)
+{
+	int sm = metrics_socket;
+
+	metrics_socket = -1;
+	if(sm >= 0)
+		shutdown(sm, SHUT_RDWR);
+}
@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "latency.h"
+
+#define METRICS_SLOTS 128 /* connections with their own counters */
+#define METRICS_BUSSES 16 /* configured interfaces with per bus counters */
+#define METRICS_TIMEOUT_MS 1000 /* a scrape has to be sent and read within this time */
+
+/* counters of one connection, only written by the process of the connection */
+struct metrics_slot {
+	pid_t pid; /* 0 if the slot is free */
+	int state;
+	uint64_t commands;
+	uint64_t parse_errors;
+	uint64_t short_writes;
+	uint64_t tx_queue; /* PDUs waiting for transmission */
+	uint64_t frames_rx[METRICS_BUSSES];
+	uint64_t frames_tx[METRICS_BUSSES];
+	uint64_t drops[METRICS_BUSSES];
+	uint64_t bcm_drops; /* drops of the BCM socket, which serves all busses */
+	uint32_t latency[METRICS_BUSSES][LATENCY_KINDS][LATENCY_BUCKETS];
+};
+
+/* slot of this connection or NULL if there is none */
+extern struct metrics_slot *metrics;
+extern int metrics_port;
+
+/*
+ * Every process only writes its own slot, so the counters are updated
+ * without locks or atomic operations. Readers may see slightly stale
+ * values.
+ */
+#define METRIC_INC(field) do { if(metrics) metrics->field++; } while(0)
+#define METRIC_ADD(field, n) do { if(metrics) metrics->field += (n); } while(0)
+#define METRIC_SET(field, value) do { if(metrics) metrics->field = (value); } while(0)
+#define METRIC_BUS_ADD(field, bus, n) do { \
+	if(metrics && (bus) >= 0 && busses[bus].iface < METRICS_BUSSES) \
+		metrics->field[busses[bus].iface] += (n); \
+	} while(0)
+#define METRIC_SEND(ret, len) do { if((ret) < (int) (len)) METRIC_INC(short_writes); } while(0)
+
+int metrics_init(void);
+void metrics_attach(void);
+void metrics_release(pid_t pid);
+struct metrics_slot *metrics_slot(int i);
+int metrics_connections(void);
+char *metrics_format(size_t *len);
+void *metrics_loop(void *ptr);
+void metrics_stop(void);
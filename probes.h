@@ -0,0 +1,22 @@
+/*
+ * Statically defined tracepoints (USDT) for perf and bpftrace, e.g.
+ *
+ *   bpftrace -e 'usdt:./socketcand:socketcand:frame_rx { @[arg0] = count(); }'
+ *
+ * With sys/sdt.h a probe is a single nop and a note in the binary that the
+ * tracers patch when they attach. Without it the probes compile to nothing.
+ * The arguments are only evaluated into registers at the probe site.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(socketcand, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(socketcand, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(socketcand, name, a1, a2, a3, a4)
+#define PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(socketcand, name, a1, a2, a3, a4, a5)
+#else
+#define PROBE2(name, a1, a2) do {} while(0)
+#define PROBE3(name, a1, a2, a3) do {} while(0)
+#define PROBE4(name, a1, a2, a3, a4) do {} while(0)
+#define PROBE5(name, a1, a2, a3, a4, a5) do {} while(0)
+#endif
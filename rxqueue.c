@@ -0,0 +1,110 @@
+#include "config.h"
+#include "socketcand.h"
+#include "rxqueue.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+
+/* receive buffer size requested by the client, 0 uses the bus setting */
+int rxqueue_rcvbuf = 0;
+
+/*
+ * Size the receive queue of a CAN socket and enable the reporting of
+ * dropped frames. For sockets serving all busses bus is -1 and the
+ * largest configured size is used.
+ */
+int rxqueue_setup(int socket, int bus)
+{
+	int i, size = rxqueue_rcvbuf;
+	const int ovfl_on = 1;
+
+	if(!size) {
+		for(i=0;i<bus_count;i++) {
+			if((bus == -1 || bus == i) && busses[i].rcvbuf > size)
+				size = busses[i].rcvbuf;
+		}
+	}
+
+	/* SO_RCVBUFFORCE is not limited by rmem_max but needs CAP_NET_ADMIN */
+	if(size > 0 &&
+	   setsockopt(socket, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+	   setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+		PRINT_ERROR("Could not set receive buffer size %d: %s\n", size, strerror(errno));
+	}
+
+	if(setsockopt(socket, SOL_SOCKET, SO_RXQ_OVFL, &ovfl_on, sizeof(ovfl_on)) < 0) {
+		PRINT_ERROR("Could not enable drop counter\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse '< rcvbuf size >'. The size is applied to the sockets opened
+ * afterwards and has to be applied to open sockets by the caller.
+ */
+int rxqueue_command(char *buf)
+{
+	int size;
+
+	if(sscanf(buf, "< %*s %d >", &size) != 1 || size < 0) {
+		METRIC_INC(parse_errors);
+		PRINT_ERROR("Syntax error in rcvbuf command\n");
+		return -1;
+	}
+
+	rxqueue_rcvbuf = size;
+	return 0;
+}
+
+/*
+ * Read the drop counter of the socket from the control messages. The
+ * kernel reports the total number of dropped frames of the socket, last
+ * holds the total of the previous call. Returns the number of frames that
+ * were dropped since then.
+ */
+__u32 rxqueue_drops(struct msghdr *msg, __u32 *last)
+{
+	struct cmsghdr *cmsg;
+	__u32 total, drops = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg);
+	     cmsg && (cmsg->cmsg_level == SOL_SOCKET);
+	     cmsg = CMSG_NXTHDR(msg,cmsg)) {
+		if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&total, CMSG_DATA(cmsg), sizeof(total));
+			drops = total - *last;
+			*last = total;
+		}
+	}
+
+	return drops;
+}
+
+/*
+ * Account dropped frames to a bus and tell the client about them. The drops
+ * of a socket serving all busses are given with bus -1, they can not be
+ * assigned to a bus as the dropped frames are gone. They are reported
+ * without bus tag.
+ */
+void rxqueue_report(int bus, __u32 drops)
+{
+	char buf[64];
+	int len;
+
+	if(bus < 0) {
+		METRIC_ADD(bcm_drops, drops);
+	} else {
+		busses[bus].rx_drops += drops;
+		METRIC_BUS_ADD(drops, bus, drops);
+	}
+
+	len = bus_prefix(buf, bus);
+	sprintf(buf + len, "drops %u >", drops);
+	send(client_socket, buf, strlen(buf), 0);
+}
@@ -0,0 +1,12 @@
+#include <sys/socket.h>
+#include <linux/types.h>
+
+/* space for the drop counter control message delivered with each recvmsg() */
+#define RXQUEUE_CTRLLEN CMSG_SPACE(sizeof(__u32))
+
+extern int rxqueue_rcvbuf;
+
+int rxqueue_setup(int socket, int bus);
+int rxqueue_command(char *buf);
+__u32 rxqueue_drops(struct msghdr *msg, __u32 *last);
+void rxqueue_report(int bus, __u32 drops);
@@ -53,6 +53,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <fcntl.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -71,24 +72,39 @@
 #include "socketcand.h"
 #include "statistics.h"
 #include "beacon.h"
+#include "flash.h"
+#include "metrics.h"
+#include "busload.h"
+#include "probes.h"
+#include "handoff.h"
 
 void print_usage(void);
 void sigint();
+void sighup();
 void childdied();
 void determine_adress();
 int receive_command(int socket, char *buf);
 
 int sl, client_socket;
-pthread_t beacon_thread, statistics_thread;
+int listeners[HANDOFF_MAX_LISTENERS];
+int listener_count = 0;
+volatile sig_atomic_t restart_flag = 0;
+pthread_t beacon_thread, metrics_thread;
 char **interface_names;
 int interface_count=0;
+int *interface_rcvbuf;
+int rcvbuf_size=0;
 int port;
 int verbose_flag=0;
 int daemon_flag=0;
 int disable_beacon=0;
 int state = STATE_NO_BUS;
 int previous_state = -1;
-char bus_name[MAX_BUSNAME];
+static int traced_state = -1; /* state reported by the mode probe */
+struct bus_entry busses[MAX_OPEN_BUSSES];
+int bus_count = 0;
+int current_bus = 0;
+int bus_tags = 0; /* messages and commands carry the name of their bus */
 char cmd_buffer[MAXLEN];
 int cmd_index=0;
 char* description;
@@ -149,6 +165,163 @@ int element_length(char *buf, int element)
 	return 0;
 }
 
+/* returns a pointer to the requested element or NULL if there is none */
+char *element_start(char *buf, int element)
+{
+	int elem = 0;
+
+	while (*buf) {
+		/* step to next non-space */
+		while (*buf == ' ')
+			buf++;
+
+		if (!*buf)
+			break;
+
+		if (elem == element)
+			return buf;
+
+		while (*buf && *buf != ' ')
+			buf++;
+
+		elem++;
+	}
+	return NULL;
+}
+
+/*
+ * convert len ASCII hex characters into len/2 bytes of binary data.
+ * returns the number of bytes or -1 if the string is no valid hex data.
+ */
+int hex2data(char *hex, int len, unsigned char *data)
+{
+	int i, hi, lo;
+
+	if (len & 1)
+		return -1;
+
+	for (i = 0; i < len / 2; i++) {
+		hi = asc2nibble(hex[2*i]);
+		lo = asc2nibble(hex[2*i + 1]);
+		if (hi > 0x0F || lo > 0x0F)
+			return -1;
+		data[i] = (hi << 4) | lo;
+	}
+	return len / 2;
+}
+
+/*
+ * Open an additional bus for this connection with '< open canbus >'.
+ * Returns the index of the bus or -1 if the bus may not be accessed.
+ */
+int open_bus(char *buf)
+{
+	char name[MAX_BUSNAME];
+	int i, found;
+
+	if(sscanf(buf, "< open %16s >", name) != 1)
+		return -1;
+
+	/* already opened by this connection */
+	for(i=0;i<bus_count;i++) {
+		if(!strcmp(busses[i].name, name))
+			return i;
+	}
+
+	/* check if access to this bus is allowed */
+	found = -1;
+	for(i=0;i<interface_count;i++) {
+		if(!strcmp(interface_names[i], name))
+			found = i;
+	}
+
+	if(found < 0 || bus_count >= MAX_OPEN_BUSSES)
+		return -1;
+
+	/* the messages of a connection only change their format on request */
+	if(bus_count && !bus_tags) {
+		PRINT_ERROR("Bus tags have to be enabled before opening another bus\n");
+		return -1;
+	}
+
+	strcpy(busses[bus_count].name, name);
+	busses[bus_count].ifindex = 0;
+	busses[bus_count].rcvbuf = interface_rcvbuf[found];
+	busses[bus_count].rx_drops = 0;
+	busses[bus_count].iface = found;
+
+	return bus_count++;
+}
+
+/*
+ * Handle '< bustags >', which switches the connection to tagged messages
+ * and commands. Returns 0 if buf is no such command.
+ */
+int bus_tags_command(char *buf)
+{
+	if(strcmp("< bustags >", buf))
+		return 0;
+
+	bus_tags = 1;
+	strcpy(buf, "< ok >");
+	send(client_socket, buf, strlen(buf), 0);
+	return 1;
+}
+
+/* find the opened bus a received message belongs to */
+int bus_by_ifindex(int ifindex)
+{
+	int i;
+
+	for(i=0;i<bus_count;i++) {
+		/* resolve lazily as the device may show up after the open command */
+		if(!busses[i].ifindex)
+			busses[i].ifindex = if_nametoindex(busses[i].name);
+
+		if(busses[i].ifindex == ifindex)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Start a message to the client. After '< bustags >' every message is
+ * tagged with the name of the bus it belongs to.
+ */
+int bus_prefix(char *buf, int bus)
+{
+	if(bus_tags && bus >= 0)
+		return sprintf(buf, "< %s ", busses[bus].name);
+
+	return sprintf(buf, "< ");
+}
+
+/*
+ * Commands may be tagged with the name of an opened bus as first element,
+ * e.g. '< vcan1 send 123 0 >'. The tag is removed from the command and
+ * selects the bus the command refers to. Untagged commands refer to the
+ * bus that was opened first.
+ */
+static void select_bus(char *buf)
+{
+	int i, len;
+
+	current_bus = 0;
+
+	if(!bus_tags)
+		return;
+
+	for(i=0;i<bus_count;i++) {
+		len = strlen(busses[i].name);
+		if(!strncmp(buf + 2, busses[i].name, len) && buf[len + 2] == ' ') {
+			current_bus = i;
+			memmove(buf + 2, buf + len + 3, strlen(buf + len + 3) + 1);
+			return;
+		}
+	}
+}
+
 int asc2nibble(char c)
 {
 	if ((c >= '0') && (c <= '9'))
@@ -165,10 +338,12 @@ int asc2nibble(char c)
 
 int main(int argc, char **argv)
 {
-	int i, found;
+	int i;
 	struct sockaddr_in clientaddr;
 	socklen_t sin_size = sizeof(clientaddr);
-	struct sigaction signalaction, sigint_action;
+	struct sigaction signalaction, sigint_action, sighup_action;
+	fd_set readfds;
+	int maxfd, received = 0;
 	sigset_t sigset;
 	char buf[MAXLEN];
 	int c;
@@ -195,6 +370,14 @@ int main(int argc, char **argv)
 		config_lookup_string(&config, "description", (const char**) &description);
 		config_lookup_string(&config, "busses", (const char**) &busses_string);
 		config_lookup_string(&config, "listen", (const char**) &interface_string);
+		config_lookup_int(&config, "rcvbuf", &rcvbuf_size);
+		config_lookup_string(&config, "flash_dir", (const char**) &flash_dir);
+		config_lookup_int(&config, "metrics_port", &metrics_port);
+		config_lookup_int(&config, "beacon_interval", &beacon_interval);
+		config_lookup_bool(&config, "beacon_load", &beacon_load);
+		config_lookup_int(&config, "bitrate", &busload_bitrate);
+		config_lookup_int(&config, "dbitrate", &busload_dbitrate);
+		config_lookup_string(&config, "handoff", (const char**) &handoff_path);
 	}
 #endif
 
@@ -210,10 +393,17 @@ int main(int argc, char **argv)
 			{"daemon", no_argument, 0, 'd'},
 			{"version", no_argument, 0, 'z'},
 			{"no-beacon", no_argument, 0, 'n'},
+			{"beacon-interval", required_argument, 0, 'B'},
+			{"beacon-load", no_argument, 0, 'L'},
+			{"rcvbuf", required_argument, 0, 'r'},
+			{"flash-dir", required_argument, 0, 'f'},
+			{"metrics-port", required_argument, 0, 'm'},
+			{"bitrate", required_argument, 0, 'b'},
+			{"handoff", required_argument, 0, 'H'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long (argc, argv, "vhni:p:l:d", long_options, &option_index);
+		c = getopt_long (argc, argv, "vhnB:Li:p:l:dr:f:m:b:H:", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -261,6 +451,39 @@ int main(int argc, char **argv)
 			disable_beacon=1;
 			break;
 
+		case 'B':
+			beacon_interval = atoi(optarg);
+			break;
+
+		case 'L':
+			beacon_load = 1;
+			break;
+
+		case 'r':
+			rcvbuf_size = atoi(optarg);
+			break;
+
+		case 'f':
+			flash_dir = malloc(strlen(optarg) + 1);
+			strcpy(flash_dir, optarg);
+			break;
+
+		case 'm':
+			metrics_port = atoi(optarg);
+			break;
+
+		case 'b':
+			if(sscanf(optarg, "%d:%d", &busload_bitrate, &busload_dbitrate) < 1) {
+				print_usage();
+				return -1;
+			}
+			break;
+
+		case 'H':
+			handoff_path = malloc(strlen(optarg) + 1);
+			strcpy(handoff_path, optarg);
+			break;
+
 		case '?':
 			print_usage();
 			return 0;
@@ -290,6 +513,18 @@ int main(int argc, char **argv)
 		interface_names[i] = strtok(NULL, ",");
 	}
 
+	/* a bus may have its own receive buffer size, e.g. can0:1048576 */
+	interface_rcvbuf = malloc(sizeof(int) * interface_count);
+	for(i=0;i<interface_count;i++) {
+		char *size = strchr(interface_names[i], ':');
+
+		interface_rcvbuf[i] = rcvbuf_size;
+		if(size) {
+			*size = '\0';
+			interface_rcvbuf[i] = atoi(size + 1);
+		}
+	}
+
 	/* if daemon mode was activated the syslog must be opened */
 	if(daemon_flag) {
 		openlog("socketcand", 0, LOG_DAEMON);
@@ -307,21 +542,44 @@ int main(int argc, char **argv)
 	sigint_action.sa_flags = 0;
 	sigaction(SIGINT, &sigint_action, NULL);
 
-	if((sl = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("inetsocket");
-		exit(1);
+	/* restart without closing the listening sockets, see handoff_start() */
+	sighup_action.sa_handler = &sighup;
+	sighup_action.sa_mask = sigset;
+	sighup_action.sa_flags = 0;
+	sigaction(SIGHUP, &sighup_action, NULL);
+
+	/*
+	 * The listening sockets may come from systemd or from a running daemon
+	 * that is replaced. The addresses are only known in the latter case,
+	 * those of systemd are wildcards or IPv6.
+	 */
+	listener_count = handoff_inherit(listeners, HANDOFF_MAX_LISTENERS);
+	if(!listener_count) {
+		listener_count = handoff_receive(listeners, HANDOFF_MAX_LISTENERS);
+		received = listener_count;
 	}
 
+	if(listener_count) {
+		sl = listeners[0];
+	} else {
+		if((sl = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+			perror("inetsocket");
+			exit(1);
+		}
+
 #ifdef DEBUG
-	if(verbose_flag)
-		printf("setting SO_REUSEADDR\n");
-	i = 1;
-	if(setsockopt(sl, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) <0) {
-		perror("setting SO_REUSEADDR failed");
-	}
+		if(verbose_flag)
+			printf("setting SO_REUSEADDR\n");
+		i = 1;
+		if(setsockopt(sl, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) <0) {
+			perror("setting SO_REUSEADDR failed");
+		}
 #endif
+	}
 
-	determine_adress();
+	/* the address of the interface is announced in the beacon and used for the metrics */
+	if(!received)
+		determine_adress();
 
 	if(!disable_beacon) {
 		PRINT_VERBOSE("creating broadcast thread...\n")
@@ -332,42 +590,107 @@ int main(int argc, char **argv)
 		PRINT_VERBOSE("Discovery beacon disabled\n");
 	}
 
-	PRINT_VERBOSE("binding socket to %s:%d\n", inet_ntoa(saddr.sin_addr), ntohs(saddr.sin_port))
-		if(bind(sl,(struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
-			perror("bind");
-			exit(-1);
+	if(!listener_count) {
+		PRINT_VERBOSE("binding socket to %s:%d\n", inet_ntoa(saddr.sin_addr), ntohs(saddr.sin_port))
+			if(bind(sl,(struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
+				perror("bind");
+				exit(-1);
+			}
+
+		if (listen(sl,3) != 0) {
+			perror("listen");
+			exit(1);
 		}
 
-	if (listen(sl,3) != 0) {
-		perror("listen");
-		exit(1);
+		listeners[0] = sl;
+		listener_count = 1;
 	}
 
-	while (1) {
-		client_socket = accept(sl,(struct sockaddr *)&clientaddr, &sin_size);
-		if (client_socket > 0 ){
-			int flag;
-			flag = 1;
-			setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
-			if (fork())
-				close(client_socket);
-			else
-				break;
+	/* a ready socket may have no connection left, accept() must not block then */
+	for(i=0;i<listener_count;i++)
+		fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK);
+
+	handoff_open();
+
+	/* the counters of all connections are kept in shared memory */
+	if(metrics_init() == 0 && metrics_port) {
+		PRINT_VERBOSE("creating metrics thread...\n")
+		i = pthread_create(&metrics_thread, NULL, &metrics_loop, NULL);
+		if(i) {
+			PRINT_ERROR("could not create metrics thread.\n");
+		}
+	}
+
+	client_socket = -1;
+	while (client_socket < 0) {
+		if(restart_flag) {
+			restart_flag = 0;
+			handoff_start(argv);
 		}
-		else {
+
+		FD_ZERO(&readfds);
+		maxfd = -1;
+		for(i=0;i<listener_count;i++) {
+			FD_SET(listeners[i], &readfds);
+			if(listeners[i] > maxfd)
+				maxfd = listeners[i];
+		}
+		if(handoff_fd() >= 0) {
+			FD_SET(handoff_fd(), &readfds);
+			if(handoff_fd() > maxfd)
+				maxfd = handoff_fd();
+		}
+
+		if(select(maxfd+1, &readfds, NULL, NULL, NULL) < 0) {
 			if (errno != EINTR) {
 				/*
 				 * If the cause for the error was NOT the
 				 * signal from a dying child => give an error
 				 */
+				perror("select");
+				exit(1);
+			}
+			continue;
+		}
+
+		if(handoff_fd() >= 0 && FD_ISSET(handoff_fd(), &readfds) &&
+		   handoff_serve(listeners, listener_count)) {
+			closelog();
+			exit(0);
+		}
+
+		for(i=0;i<listener_count;i++) {
+			if(!FD_ISSET(listeners[i], &readfds))
+				continue;
+
+			sin_size = sizeof(clientaddr);
+			client_socket = accept(listeners[i],(struct sockaddr *)&clientaddr, &sin_size);
+			if (client_socket >= 0){
+				int flag;
+				flag = 1;
+				setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
+				if (fork()) {
+					close(client_socket);
+					client_socket = -1;
+				} else {
+					/* a restart of the daemon must not interrupt the select() of a connection */
+					signal(SIGHUP, SIG_IGN);
+					break;
+				}
+			}
+			else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
 				perror("accept");
 				exit(1);
 			}
 		}
 	}
 
+	handoff_close();
+
 	PRINT_VERBOSE("client connected\n")
 
+	metrics_attach();
+
 #ifdef DEBUG
 		PRINT_VERBOSE("setting SO_REUSEADDR\n")
 		i = 1;
@@ -378,6 +701,13 @@ int main(int argc, char **argv)
 
 	/* main loop with state machine */
 	while(1) {
+		METRIC_SET(state, state);
+
+		if(state != traced_state) {
+			PROBE2(mode, traced_state, state);
+			traced_state = state;
+		}
+
 		switch(state) {
 		case STATE_NO_BUS:
 			if(previous_state != STATE_NO_BUS) {
@@ -394,16 +724,7 @@ int main(int argc, char **argv)
 			}
 
 			if(!strncmp("< open ", buf, 7)) {
-				sscanf(buf, "< open %s>", bus_name);
-
-				/* check if access to this bus is allowed */
-				found = 0;
-				for(i=0;i<interface_count;i++) {
-					if(!strcmp(interface_names[i], bus_name))
-						found = 1;
-				}
-
-				if(found) {
+				if(open_bus(buf) >= 0) {
 					strcpy(buf, "< ok >");
 					send(client_socket, buf, strlen(buf), 0);
 					state = STATE_BCM;
@@ -415,6 +736,7 @@ int main(int argc, char **argv)
 					state = STATE_SHUTDOWN;
 				}
 			} else {
+				METRIC_INC(parse_errors);
 				PRINT_ERROR("unknown command '%s'.\n", buf)
 					strcpy(buf, "< error unknown command >");
 				send(client_socket, buf, strlen(buf), 0);
@@ -444,15 +766,25 @@ int main(int argc, char **argv)
 }
 
 /* reads all available data from the socket into the command buffer.
- * returns '-1' if no command could be received.
+ * returns '-1' if no command could be received and '1' if there was
+ * nothing to read.
  */
 int receive_command(int socket, char *buffer) {
 	int i, start, stop;
+	char c;
 
 	/* if there are no more elements in the buffer read more data from the
 	 * socket.
 	 */
 	if(!more_elements) {
+		/* acknowledgement timestamps wake up select() without any data */
+		if(latency_ack) {
+			latency_errqueue(socket);
+			if(recv(socket, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+			   (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 1;
+		}
+
 		cmd_index += read(socket, cmd_buffer+cmd_index, MAXLEN-cmd_index);
 #ifdef DEBUG_RECEPTION
 		PRINT_VERBOSE("\tRead from socket\n");
@@ -517,6 +849,10 @@ int receive_command(int socket, char *buffer) {
 	PRINT_VERBOSE("\tElement is '%s'\n", buffer);
 #endif
 
+	select_bus(buffer);
+	METRIC_INC(commands);
+	PROBE3(command, current_bus, buffer, stop - start + 1);
+
 	/* if only this message was in the buffer we're done */
 	if(stop == cmd_index-1) {
 		cmd_index = 0;
@@ -600,7 +936,7 @@ void determine_adress() {
 void print_usage(void) {
 	printf("%s Version %s\n", PACKAGE_NAME, PACKAGE_VERSION);
 	printf("Report bugs to %s\n\n", PACKAGE_BUGREPORT);
-	printf("Usage: socketcand [-v | --verbose] [-i interfaces | --interfaces interfaces]\n\t\t[-p port | --port port] [-l ip_addr | --listen interface]\n\t\t[-n | --no-beacon]\n\n");
+	printf("Usage: socketcand [-v | --verbose] [-i interfaces | --interfaces interfaces]\n\t\t[-p port | --port port] [-l ip_addr | --listen interface]\n\t\t[-n | --no-beacon] [-B secs | --beacon-interval secs]\n\t\t[-L | --beacon-load]\n\t\t[-r size | --rcvbuf size] [-f dir | --flash-dir dir]\n\t\t[-m port | --metrics-port port] [-b rate[:drate] | --bitrate rate[:drate]]\n\t\t[-H path | --handoff path]\n\n");
 	printf("Options:\n");
 	printf("\t-v activates verbose output to STDOUT\n");
 	printf("\t-i comma separated list of SocketCAN interfaces the daemon shall\n\t\tprovide access to (e.g. -i can0,vcan1)\n");
@@ -608,11 +944,27 @@ void print_usage(void) {
 	printf("\t-l interface changes the default network interface the daemon will\n\t\tbind to\n");
 	printf("\t-d set this flag if you want log to syslog instead of STDOUT\n");
 	printf("\t-n deactivates the discovery beacon\n");
+	printf("\t-B secs sets the interval of the discovery beacon (default %d),\n\t\t0 only answers discovery queries\n", BEACON_INTERVAL);
+	printf("\t-L adds the load of the daemon to the discovery beacon\n");
+	printf("\t-r size sets the receive buffer size of the CAN sockets in bytes.\n\t\tA single bus can be set with -i can0:size\n");
+	printf("\t-f dir allows clients to flash the image files in this directory\n");
+	printf("\t-m port serves metrics for Prometheus via HTTP on this port\n");
+	printf("\t-b rate[:drate] bitrate (and CAN FD data bitrate) for the bus load of\n\t\tinterfaces that report none, e.g. vcan\n");
+	printf("\t-H path hands the listening sockets over to a new daemon through\n\t\tthis unix socket on SIGHUP or when one is started\n");
 	printf("\t-h prints this message\n");
 }
 
 void childdied() {
-	wait(NULL);
+	pid_t pid;
+
+	/* several children may have terminated for a single signal */
+	while((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		metrics_release(pid);
+}
+
+void sighup() {
+	/* the new daemon is started from the accept loop */
+	restart_flag = 1;
 }
 
 void sigint() {
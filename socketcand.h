@@ -4,10 +4,14 @@
 /* max. length for ISO 15765-2 PDUs */
 #define ISOTPLEN 4095
 
-/* receive buffer length from inet socket for an isotp PDU plus command */
+/*
+ * receive buffer length from inet socket for an isotp PDU plus command.
+ * Longer PDUs are transferred in parts of ISOTPLEN bytes.
+ */
 #define MAXLEN (2 * ISOTPLEN + 100) /* 4095 * 2 + cmd stuff */
 
 #define MAX_BUSNAME 16+1
+#define MAX_OPEN_BUSSES 8
 #define PORT 29536
 
 #define STATE_NO_BUS 0
@@ -27,6 +31,15 @@
 
 #undef DEBUG_RECEPTION
 
+/* a bus opened by the client with '< open >' */
+struct bus_entry {
+	char name[MAX_BUSNAME];
+	int ifindex;
+	int rcvbuf; /* receive buffer size of the CAN sockets, 0 = default */
+	unsigned int rx_drops; /* frames dropped in the CAN socket queues */
+	int iface; /* index of the bus in the configured interfaces */
+};
+
 void state_bcm();
 void state_raw();
 void state_isotp();
@@ -35,14 +48,18 @@ void state_control();
 extern int client_socket;
 extern char **interface_names;
 extern int interface_count;
+extern int *interface_rcvbuf;
 extern int port;
 extern int verbose_flag;
 extern int daemon_flag;
 extern int state;
 extern int previous_state;
-extern char bus_name[];
+extern struct bus_entry busses[];
+extern int bus_count;
+extern int current_bus;
+extern int bus_tags;
 extern char* description;
-extern pthread_t statistics_thread;
+extern char* interface_string;
 extern int more_elements;
 extern struct sockaddr_in broadcast_addr;
 extern struct sockaddr_in saddr;
@@ -50,4 +67,10 @@ extern struct sockaddr_in saddr;
 int receive_command(int socket, char *buf);
 int state_changed(char *buf, int current_state);
 int element_length(char *buf, int element);
+char *element_start(char *buf, int element);
+int hex2data(char *hex, int len, unsigned char *data);
 int asc2nibble(char c);
+int open_bus(char *buf);
+int bus_tags_command(char *buf);
+int bus_by_ifindex(int ifindex);
+int bus_prefix(char *buf, int bus);
@@ -45,6 +45,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -53,12 +54,16 @@
 #include <errno.h>
 #include <getopt.h>
 #include <netdb.h>
+#include <time.h>
+#include <poll.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/uio.h>
+#include <sys/epoll.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -66,12 +71,21 @@
 
 #include <linux/can.h>
 
+#include "bench.h"
+
 #define MAXLEN 4000
 #define PORT 29536
+#define BATCH 32 /* frames read or written with one system call */
+#define SEND_LEN 48 /* max. length of a send command for a CAN frame */
 
 #define STATE_INIT 0
 #define STATE_CONNECTED 1
 #define STATE_SHUTDOWN 2
+#define STATE_RECONNECT 3
+
+#define RECONNECT_MIN_MS 100 /* first delay before a new connection attempt */
+#define RECONNECT_MAX_MS 30000 /* the delay doubles up to this limit */
+#define RING_FRAMES 10000 /* default number of frames buffered while disconnected */
 
 #define PRINT_INFO(...) printf(__VA_ARGS__);
 #define PRINT_ERROR(...) fprintf(stderr, __VA_ARGS__);
@@ -81,9 +95,25 @@ void print_usage(void);
 void sigint();
 int receive_command(int socket, char *buf);
 void state_connected();
-
-int server_socket;
-int raw_socket;
+void state_reconnect();
+int connect_server();
+
+/* a local frame waiting for the connection to the server */
+struct ring_entry {
+	struct can_frame frame;
+	uint64_t time; /* ms of CLOCK_MONOTONIC when the frame was received */
+};
+
+int server_socket = -1;
+int raw_socket = -1;
+struct sockaddr_in serveraddr;
+int reconnect_flag = 0;
+int reconnect_delay = RECONNECT_MIN_MS;
+struct ring_entry *ring;
+int ring_size = RING_FRAMES;
+int ring_head = 0, ring_count = 0;
+int ring_max_age = 0; /* ms, 0 keeps the frames until they are overwritten */
+unsigned long ring_dropped = 0;
 int port;
 int verbose_flag=0;
 int cmd_index=0;
@@ -98,18 +128,18 @@ char cmd_buffer[MAXLEN];
 int main(int argc, char **argv)
 {
 	int i, c;
-	struct sockaddr_in serveraddr;
 	struct hostent *server_ent;
 	struct sigaction sigint_action;
 	sigset_t sigset;
 	char buf[MAXLEN];
 	char* server_string;
+	int bench = -1, bench_count = BENCH_COUNT, bench_size = BENCH_PDU_SIZE, bench_json = 0;
 
 	/* set default config settings */
 	port = PORT;
 	strcpy(ldev, "can0");
 	strcpy(rdev,"can0");
-	server_string = malloc(strlen("localhost"));
+	server_string = strdup("localhost");
 
 
 	/* Parse commandline arguments */
@@ -122,10 +152,17 @@ int main(int argc, char **argv)
 			{"server", required_argument, 0, 's'},
 			{"port", required_argument, 0, 'p'},
 			{"version", no_argument, 0, 'z'},
+			{"bench", required_argument, 0, 'b'},
+			{"count", required_argument, 0, 'n'},
+			{"size", required_argument, 0, 'S'},
+			{"json", no_argument, 0, 'j'},
+			{"reconnect", no_argument, 0, 'r'},
+			{"buffer", required_argument, 0, 'B'},
+			{"max-age", required_argument, 0, 'a'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "vhi:p:l:s:", long_options, &option_index);
+		c = getopt_long(argc, argv, "vhi:p:l:s:b:n:S:jrB:a:", long_options, &option_index);
 
 		if(c == -1)
 			break;
@@ -147,8 +184,8 @@ int main(int argc, char **argv)
 			break;
 
 		case 's':
-			server_string = realloc(server_string,strlen(optarg));
-			strcpy(server_string, optarg);
+			free(server_string);
+			server_string = strdup(optarg);
 			break;
 
 		case 'i':
@@ -156,6 +193,46 @@ int main(int argc, char **argv)
 			strcpy(ldev, strtok(NULL, ","));
 			break;
 
+		case 'b':
+			bench = bench_pattern(optarg);
+			if(bench < 0) {
+				print_usage();
+				return -1;
+			}
+			break;
+
+		case 'n':
+			bench_count = atoi(optarg);
+			break;
+
+		case 'S':
+			bench_size = atoi(optarg);
+			if(bench_size < 1 || bench_size > 4095) {
+				print_usage();
+				return -1;
+			}
+			break;
+
+		case 'j':
+			bench_json = 1;
+			break;
+
+		case 'r':
+			reconnect_flag = 1;
+			break;
+
+		case 'B':
+			ring_size = atoi(optarg);
+			if(ring_size < 1) {
+				print_usage();
+				return -1;
+			}
+			break;
+
+		case 'a':
+			ring_max_age = atoi(optarg);
+			break;
+
 		case 'h':
 			print_usage();
 			return 0;
@@ -180,16 +257,15 @@ int main(int argc, char **argv)
 	sigint_action.sa_flags = 0;
 	sigaction(SIGINT, &sigint_action, NULL);
 
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if(server_socket < 0) {
-		perror("socket");
-		exit(1);
-	}
-
 	bzero(&serveraddr, sizeof(serveraddr));
 	serveraddr.sin_family = AF_INET;
 	serveraddr.sin_port = htons(port);
 
+	if(!server_string) {
+		perror("strdup");
+		exit(1);
+	}
+
 	server_ent = gethostbyname(server_string);
 	if(server_ent == 0) {
 		perror(server_string);
@@ -200,10 +276,26 @@ int main(int argc, char **argv)
 	      server_ent->h_length);
 
 
-	if(connect(server_socket, (struct sockaddr*)&serveraddr,
-		   sizeof(serveraddr)) != 0) {
-		perror("connect");
+	server_socket = connect_server();
+	if(server_socket < 0)
 		exit(1);
+
+	if(reconnect_flag) {
+		/* a lost connection is handled where send() fails */
+		signal(SIGPIPE, SIG_IGN);
+
+		ring = malloc(ring_size * sizeof(*ring));
+		if(!ring) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	if(bench >= 0) {
+		i = bench_run(server_socket, bench, rdev, ldev, bench_count > 0 ? bench_count : 1,
+			      bench_size, bench_json);
+		close(server_socket);
+		return i ? 1 : 0;
 	}
 
 
@@ -214,8 +306,7 @@ int main(int argc, char **argv)
 			i = receive_command(server_socket, (char *) &buf);
 			if(i != 0) {
 				PRINT_ERROR("Connection terminated while waiting for command.\n");
-				state = STATE_SHUTDOWN;
-				previous_state = STATE_INIT;
+				state = reconnect_flag ? STATE_RECONNECT : STATE_SHUTDOWN;
 				break;
 			}
 
@@ -234,6 +325,9 @@ int main(int argc, char **argv)
 		case STATE_CONNECTED:
 			state_connected();
 			break;
+		case STATE_RECONNECT:
+			state_reconnect();
+			break;
 		case STATE_SHUTDOWN:
 			PRINT_VERBOSE("Closing client connection.\n");
 			close(server_socket);
@@ -244,17 +338,391 @@ int main(int argc, char **argv)
 }
 
 
-inline void state_connected()
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/* value of a hex digit or -1 */
+static inline int hex_nibble(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* write '< send can_id dlc data >' for a frame to buf, returns the length */
+static int format_send(char *buf, struct can_frame *frame)
 {
+	char *p = buf;
+	canid_t id;
+	int i, digits;
 
+	memcpy(p, "< send ", 7);
+	p += 7;
+
+	if(frame->can_id & CAN_EFF_FLAG) {
+		id = frame->can_id & CAN_EFF_MASK;
+		digits = 8;
+	} else {
+		id = frame->can_id & CAN_SFF_MASK;
+		digits = 3;
+	}
+	for(i=digits-1; i>=0; i--, id >>= 4)
+		p[i] = hex_digits[id & 0xF];
+	p += digits;
+
+	*p++ = ' ';
+	*p++ = '0' + frame->can_dlc;
+
+	for(i=0; i<frame->can_dlc; i++) {
+		*p++ = ' ';
+		*p++ = hex_digits[frame->data[i] >> 4];
+		*p++ = hex_digits[frame->data[i] & 0xF];
+	}
+
+	memcpy(p, " >", 2);
+	return p + 2 - buf;
+}
+
+/*
+ * Parse '< frame can_id [seconds.useconds] [data] >' between the brackets
+ * at start and stop. Returns -1 for other messages.
+ */
+static int parse_frame(char *start, char *stop, struct can_frame *frame)
+{
+	char *p = start + 8;
+	int n, digits, hi, lo;
+
+	if(stop - start < 9 || memcmp(start, "< frame ", 8))
+		return -1;
+
+	memset(frame, 0, sizeof(*frame));
+
+	for(digits=0; p<stop && (n = hex_nibble(*p)) >= 0; p++, digits++)
+		frame->can_id = (frame->can_id << 4) | n;
+	if(!digits || digits > 8)
+		return -1;
+	if(digits > 3)
+		frame->can_id |= CAN_EFF_FLAG;
+
+	while(p < stop && *p == ' ')
+		p++;
+
+	/* skip the timestamp */
+	if(memchr(p, '.', stop - p)) {
+		while(p < stop && *p != ' ')
+			p++;
+		while(p < stop && *p == ' ')
+			p++;
+	}
+
+	while(p + 1 < stop && frame->can_dlc < 8) {
+		if((hi = hex_nibble(p[0])) < 0 || (lo = hex_nibble(p[1])) < 0)
+			break;
+		frame->data[frame->can_dlc++] = (hi << 4) | lo;
+		p += 2;
+	}
+
+	return 0;
+}
+
+/* write frames to the local bus with a single system call where possible */
+static void bridge_flush(struct can_frame *frames, int count)
+{
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovs[BATCH];
 	int i, ret;
-	static struct can_frame frame;
-	char data_str[2*8];
+
+	memset(msgs, 0, sizeof(msgs[0]) * count);
+	for(i=0; i<count; i++) {
+		iovs[i].iov_base = &frames[i];
+		iovs[i].iov_len = sizeof(struct can_frame);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for(i=0; i<count; i+=ret) {
+		ret = sendmmsg(raw_socket, msgs + i, count - i, 0);
+		if(ret <= 0) {
+			perror("Writing CAN frame to can socket\n");
+			return;
+		}
+	}
+}
+
+/* forward the frames of all complete messages in the command buffer */
+static void bridge_parse(void)
+{
+	struct can_frame frames[BATCH];
+	char *p, *start, *stop, *end;
+	int count = 0;
+
+	p = cmd_buffer;
+	end = cmd_buffer + cmd_index;
+
+	while((start = memchr(p, '<', end - p)) && (stop = memchr(start, '>', end - start))) {
+		if(!parse_frame(start, stop, &frames[count]) && ++count == BATCH) {
+			bridge_flush(frames, count);
+			count = 0;
+		}
+		p = stop + 1;
+	}
+
+	if(count)
+		bridge_flush(frames, count);
+
+	/* keep an incomplete message, a full buffer without one is garbage */
+	if(!start || (start == cmd_buffer && cmd_index == MAXLEN)) {
+		cmd_index = 0;
+	} else {
+		cmd_index = end - start;
+		memmove(cmd_buffer, start, cmd_index);
+	}
+}
+
+/* read from the server and forward the frames */
+static int bridge_server(void)
+{
+	int ret;
+
+	ret = read(server_socket, cmd_buffer + cmd_index, MAXLEN - cmd_index);
+	if(ret <= 0)
+		return -1;
+	cmd_index += ret;
+
+	bridge_parse();
+	return 0;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* keep a frame for the server, the oldest one is overwritten if the ring is full */
+static void ring_put(struct can_frame *frame, uint64_t time)
+{
+	int i;
+
+	if(ring_count == ring_size) {
+		ring_head = (ring_head + 1) % ring_size;
+		ring_count--;
+		ring_dropped++;
+	}
+
+	i = (ring_head + ring_count) % ring_size;
+	ring[i].frame = *frame;
+	ring[i].time = time;
+	ring_count++;
+}
+
+/* read a batch of frames from the local bus, returns their number or -1 */
+static int bridge_read(struct can_frame *frames)
+{
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovs[BATCH];
+	int i, n, count;
+
+	memset(msgs, 0, sizeof(msgs));
+	for(i=0; i<BATCH; i++) {
+		iovs[i].iov_base = &frames[i];
+		iovs[i].iov_len = sizeof(struct can_frame);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = recvmmsg(raw_socket, msgs, BATCH, MSG_DONTWAIT, NULL);
+	if(n < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		perror("Reading CAN socket\n");
+		return -1;
+	}
+
+	for(i=0, count=0; i<n; i++) {
+		if(msgs[i].msg_len < sizeof(struct can_frame))
+			continue;
+		/* error and remote frames are not forwarded */
+		if(frames[i].can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG))
+			continue;
+		frames[count++] = frames[i];
+	}
+
+	return count;
+}
+
+/*
+ * Send frames to the server as one write. sent is set to the number of
+ * frames whose command was written completely.
+ */
+static int bridge_forward(struct can_frame *frames, int n, int *sent)
+{
+	char out[BATCH * SEND_LEN];
+	int ends[BATCH];
+	int i, len, done, ret;
+
+	for(i=0, len=0; i<n; i++) {
+		len += format_send(out + len, &frames[i]);
+		ends[i] = len;
+	}
+
+	for(done=0; done<len; done+=ret) {
+		ret = send(server_socket, out + done, len - done, MSG_NOSIGNAL);
+		if(ret < 0) {
+			perror("Error sending TCP frame\n");
+			for(*sent=0; *sent<n && ends[*sent]<=done; (*sent)++)
+				;
+			return -1;
+		}
+	}
+
+	*sent = n;
+	return 0;
+}
+
+/* send the frames received on the local bus to the server */
+static int bridge_can(void)
+{
+	struct can_frame frames[BATCH];
+	uint64_t now;
+	int i, n, sent;
+
+	n = bridge_read(frames);
+	if(n <= 0)
+		return n;
+
+	if(bridge_forward(frames, n, &sent) < 0) {
+		if(reconnect_flag) {
+			now = now_ms();
+			for(i=sent; i<n; i++)
+				ring_put(&frames[i], now);
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the frames buffered while the connection was down in their order.
+ * The send command has no timestamp, the frames get new ones on the
+ * remote bus.
+ */
+static int bridge_replay(void)
+{
+	struct can_frame frames[BATCH];
+	uint64_t now = now_ms();
+	int i, n, sent, ret;
+
+	/* the oldest frames are at the head */
+	while(ring_count && ring_max_age > 0 && now - ring[ring_head].time > (uint64_t) ring_max_age) {
+		ring_head = (ring_head + 1) % ring_size;
+		ring_count--;
+		ring_dropped++;
+	}
+
+	if(ring_dropped) {
+		PRINT_ERROR("%lu frames of the local bus were dropped while disconnected\n", ring_dropped);
+		ring_dropped = 0;
+	}
+
+	while(ring_count) {
+		n = (ring_count < BATCH) ? ring_count : BATCH;
+		for(i=0; i<n; i++)
+			frames[i] = ring[(ring_head + i) % ring_size].frame;
+
+		ret = bridge_forward(frames, n, &sent);
+		ring_head = (ring_head + sent) % ring_size;
+		ring_count -= sent;
+		if(ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* connect to the server, returns the socket or -1 */
+int connect_server()
+{
+	int s;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if(s < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if(connect(s, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) != 0) {
+		if(!reconnect_flag || verbose_flag)
+			perror("connect");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/*
+ * Wait with exponential backoff and connect again. Frames of the local bus
+ * are kept in the ring meanwhile. The bus is opened again in STATE_INIT.
+ */
+void state_reconnect()
+{
+	struct can_frame frames[BATCH];
+	struct pollfd pfd;
+	uint64_t deadline, now;
+	int i, n;
+
+	if(server_socket >= 0) {
+		PRINT_ERROR("Connection to the server lost, reconnecting\n");
+		close(server_socket);
+		server_socket = -1;
+	}
+	cmd_index = 0;
+	more_elements = 0;
+
+	deadline = now_ms() + reconnect_delay;
+	while((now = now_ms()) < deadline) {
+		pfd.fd = raw_socket;
+		pfd.events = POLLIN;
+		if(poll(&pfd, raw_socket >= 0, deadline - now) <= 0)
+			continue;
+
+		n = bridge_read(frames);
+		now = now_ms();
+		for(i=0; i<n; i++)
+			ring_put(&frames[i], now);
+	}
+
+	if(reconnect_delay < RECONNECT_MAX_MS)
+		reconnect_delay = (reconnect_delay * 2 < RECONNECT_MAX_MS) ? reconnect_delay * 2 : RECONNECT_MAX_MS;
+
+	server_socket = connect_server();
+	if(server_socket >= 0) {
+		if(verbose_flag)
+			PRINT_INFO("Connected to the server again\n");
+		state = STATE_INIT;
+	}
+}
+
+/*
+ * Bridge the remote and the local bus in a single event loop. Frames are
+ * read and written in batches in both directions.
+ */
+void state_connected()
+{
 	static struct ifreq ifr;
 	static struct sockaddr_can addr;
-	fd_set readfds;
+	struct epoll_event ev, events[2];
+	int i, n, epoll_fd;
 
-	if(previous_state != STATE_CONNECTED) {
+	/* the local bus stays open while the client reconnects */
+	if(raw_socket < 0) {
 
 		if((raw_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
 			PRINT_ERROR("Error while creating RAW socket %s\n", strerror(errno));
@@ -272,14 +740,6 @@ inline void state_connected()
 		addr.can_family = AF_CAN;
 		addr.can_ifindex = ifr.ifr_ifindex;
 
-		/* turn on timestamp */
-		const int timestamp_on = 0;
-		if(setsockopt(raw_socket, SOL_SOCKET, SO_TIMESTAMP,
-			      &timestamp_on, sizeof(timestamp_on)) < 0) {
-			PRINT_ERROR("Could not enable CAN timestamps\n");
-			state = STATE_SHUTDOWN;
-			return;
-		}
 		/* bind socket */
 		if(bind(raw_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
 			PRINT_ERROR("Error while binding RAW socket %s\n", strerror(errno));
@@ -289,114 +749,51 @@ inline void state_connected()
 		previous_state = STATE_CONNECTED;
 	}
 
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd < 0) {
+		PRINT_ERROR("Error in epoll_create1() %s\n", strerror(errno));
+		state = STATE_SHUTDOWN;
+		return;
+	}
 
-	if(fork()) {
-
-		for(;;) {
-
-			FD_ZERO(&readfds);
-			FD_SET(server_socket, &readfds);
+	ev.events = EPOLLIN;
+	ev.data.fd = server_socket;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev);
+	ev.data.fd = raw_socket;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, raw_socket, &ev);
 
-			/*
-			 * Check if there are more elements in the element buffer before
-			 * calling select() and blocking for new packets.
-			 */
-			if(!more_elements) {
-				ret = select(server_socket+1, &readfds, NULL, NULL, NULL);
+	/* frames that arrived together with the greeting */
+	more_elements = 0;
+	bridge_parse();
 
-				if(ret < 0) {
-					PRINT_ERROR("Error in select()\n")
-						state = STATE_SHUTDOWN;
-					return;
-				}
-			}
+	reconnect_delay = RECONNECT_MIN_MS;
+	if(ring_count || ring_dropped) {
+		if(bridge_replay() < 0)
+			goto shutdown;
+	}
 
-			if(FD_ISSET(server_socket, &readfds) || more_elements) {
-				ret = receive_command(server_socket, (char *) &buf);
-				if(ret == 0) {
-					if(!strncmp("< frame", buf, 7)) {
-						sscanf(buf, "< frame %x %*d.%*d %s >", &frame.can_id,
-						       data_str);
-
-						char* s = buf + 7;
-						for(; ++s;) {
-							if(*s== ' ') {
-								break;
-							}
-						}
-						if((s - buf - 7) > 4)
-							frame.can_id |= CAN_EFF_FLAG;
-
-						frame.can_dlc = strlen(data_str) / 2;
-
-						sscanf(data_str, "%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx",
-						       &frame.data[0], &frame.data[1],
-						       &frame.data[2], &frame.data[3],
-						       &frame.data[4], &frame.data[5],
-						       &frame.data[6], &frame.data[7]);
-
-						ret = write(raw_socket, &frame, sizeof(struct can_frame));
-						if(ret<sizeof(struct can_frame)) {
-							perror("Writing CAN frame to can socket\n");
-						}
-					}
-				}
-			} else {
-				ret = read(server_socket, &buf, 0);
-				if(ret == -1) {
-					state = STATE_SHUTDOWN;
-					return;
-				}
-			}
+	for(;;) {
+		n = epoll_wait(epoll_fd, events, 2, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			PRINT_ERROR("Error in epoll_wait()\n")
+			break;
 		}
-	} else {
-
-		for(;;) {
-
-			FD_ZERO(&readfds);
-			FD_SET(raw_socket, &readfds);
 
-			ret = select(raw_socket+1, &readfds, NULL, NULL, NULL);
-			if(ret < 0) {
-				PRINT_ERROR("Error in select()\n")
-					state = STATE_SHUTDOWN;
-				return;
-			}
-
-			if(FD_ISSET(raw_socket, &readfds)) {
-				ret = recv(raw_socket, &frame, sizeof(struct can_frame), MSG_WAITALL);
-				if(ret < sizeof(struct can_frame)) {
-					PRINT_ERROR("Error reading frame from RAW socket\n")
-						perror("Reading CAN socket\n");
-				} else {
-					if(frame.can_id & CAN_ERR_FLAG) {
-						/* TODO implement */
-					} else if(frame.can_id & CAN_RTR_FLAG) {
-						/* TODO implement */
-					} else {
-						if(frame.can_id & CAN_EFF_FLAG) {
-							ret = sprintf(buf, "< send %08X %d ",
-								      frame.can_id & CAN_EFF_MASK, frame.can_dlc);
-						} else {
-							ret = sprintf(buf, "< send %03X %d ",
-								      frame.can_id & CAN_SFF_MASK, frame.can_dlc);
-						}
-						for(i=0; i<frame.can_dlc; i++) {
-							ret += sprintf(buf+ret, "%02x ", frame.data[i]);
-						}
-						sprintf(buf+ret, " >");
-
-						const size_t len = strlen(buf);
-						ret = send(server_socket, buf, len, 0);
-						if(ret < sizeof(len)) {
-							perror("Error sending TCP frame\n");
-						}
-					}
-				}
+		for(i=0; i<n; i++) {
+			if(events[i].data.fd == server_socket) {
+				if(bridge_server() < 0)
+					goto shutdown;
+			} else if(bridge_can() < 0) {
+				goto shutdown;
 			}
 		}
 	}
 
+shutdown:
+	close(epoll_fd);
+	state = reconnect_flag ? STATE_RECONNECT : STATE_SHUTDOWN;
 }
 
 /* reads all available data from the socket into the command buffer.
@@ -498,12 +895,19 @@ int receive_command(int socket, char *buffer)
 
 void print_usage(void)
 {
-	printf("Usage: socketcandcl [-v | --verbose] [-i interfaces | --interfaces interfaces]\n\t\t[-s server | --server server ]\n\t\t[-p port | --port port]\n");
+	printf("Usage: socketcandcl [-v | --verbose] [-i interfaces | --interfaces interfaces]\n\t\t[-s server | --server server ]\n\t\t[-p port | --port port]\n\t\t[-b pattern | --bench pattern] [-n count | --count count]\n\t\t[-S size | --size size] [-j | --json]\n\t\t[-r | --reconnect] [-B frames | --buffer frames] [-a ms | --max-age ms]\n");
 	printf("Options:\n");
 	printf("\t-v activates verbose output to STDOUT\n");
 	printf("\t-s server hostname\n");
 	printf("\t-i SocketCAN interfaces to use: device_server,device_client \n");
 	printf("\t-p port changes the default port (%d) the client connects to\n", PORT);
+	printf("\t-b pattern measures the server instead of bridging the busses:\n\t\techo (round trips), send (send commands), receive (frames\n\t\tgenerated on the local bus) or isotp (PDUs echoed on the local bus)\n");
+	printf("\t-n number of round trips, frames or PDUs (default %d)\n", BENCH_COUNT);
+	printf("\t-S length of the ISO-TP PDUs (default %d)\n", BENCH_PDU_SIZE);
+	printf("\t-j prints the results of the benchmark as JSON\n");
+	printf("\t-r connects again if the connection to the server is lost\n");
+	printf("\t-B frames of the local bus buffered while disconnected (default %d)\n", RING_FRAMES);
+	printf("\t-a ms discards buffered frames older than this, 0 keeps all\n");
 	printf("\t-h prints this message\n");
 }
 
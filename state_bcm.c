@@ -1,6 +1,12 @@
 #include "config.h"
 #include "socketcand.h"
 #include "statistics.h"
+#include "timestamp.h"
+#include "rxqueue.h"
+#include "transact.h"
+#include "metrics.h"
+#include "probes.h"
+#include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,18 +29,95 @@
 #include <linux/can/error.h>
 
 #define RXLEN 128
+#define MAX_BCM_FRAMES 256
+
+static int sc = -1;
+static __u32 sc_drops;
+static fd_set readfds;
+static struct timespec ts;
+
+/* BCM message with a sequence of frames for multi frame jobs */
+static struct {
+	struct bcm_msg_head msg_head;
+	struct can_frame frames[MAX_BCM_FRAMES];
+} seqmsg;
+
+/*
+ * Fill the frames of seqmsg from the elements starting at 'element'. Each
+ * element contains the can_dlc data bytes of one frame as ASCII hex values.
+ * Returns the number of frames or -1 on a syntax error.
+ */
+static int parse_frame_sequence(char *buf, int element, canid_t can_id, __u8 can_dlc)
+{
+	char *data = element_start(buf, element);
+	int len, nframes = 0;
+
+	while (data && *data != '>') {
+		len = strcspn(data, " ");
+
+		if (nframes == MAX_BCM_FRAMES || len != 2 * can_dlc)
+			return -1;
+
+		if (hex2data(data, len, seqmsg.frames[nframes].data) < 0)
+			return -1;
+
+		seqmsg.frames[nframes].can_id = can_id;
+		seqmsg.frames[nframes].can_dlc = can_dlc;
+		nframes++;
+
+		data += len;
+		data += strspn(data, " ");
+	}
+
+	return nframes;
+}
+
+/*
+ * Parse the optional '[timeout_s timeout_us [resume]]' elements of the
+ * reception commands starting at 'element'. A timeout arms the RX_TIMEOUT
+ * monitoring of the broadcast manager. Returns -1 on a syntax error.
+ */
+static int parse_rx_timeout(char *buf, int element, struct bcm_msg_head *head, int *resume)
+{
+	char *opt = element_start(buf, element);
+	int items;
+
+	*resume = 0;
+
+	if (!opt)
+		return -1;
+
+	items = sscanf(opt, "%lu %lu %d >",
+		       &head->ival1.tv_sec,
+		       &head->ival1.tv_usec,
+		       resume);
+
+	if (items <= 0)
+		return (*opt == '>') ? 0 : -1;
+
+	if (items == 1)
+		return -1;
+
+	if (head->ival1.tv_sec || head->ival1.tv_usec)
+		head->flags |= STARTTIMER;
+
+	if (*resume)
+		head->flags |= RX_ANNOUNCE_RESUME;
 
-int sc = -1;
-fd_set readfds;
-struct timeval tv;
+	return 0;
+}
 
 void state_bcm() {
-	int i, ret;
+	int i, ret, maxfd, bus;
+	struct timeval timeout;
 	struct sockaddr_can caddr;
 	socklen_t caddrlen = sizeof(caddr);
 	struct ifreq ifr;
 	char rxmsg[RXLEN];
 	char buf[MAXLEN];
+	char ctrlmsg[TIMESTAMP_CTRLLEN + RXQUEUE_CTRLLEN];
+	struct iovec iov;
+	struct msghdr rxhdr;
 
 	struct {
 		struct bcm_msg_head msg_head;
@@ -59,6 +142,12 @@ void state_bcm() {
 				state = STATE_SHUTDOWN;
 				return;
 			}
+
+		if(timestamp_enable(sc) < 0 || rxqueue_setup(sc, -1) < 0) {
+			state = STATE_SHUTDOWN;
+			return;
+		}
+		sc_drops = 0;
 		previous_state = STATE_BCM;
 	}
 
@@ -73,7 +162,8 @@ void state_bcm() {
 	if(more_elements) {
 		FD_CLR(sc, &readfds);
 	} else {
-		ret = select((sc > client_socket)?sc+1:client_socket+1, &readfds, NULL, NULL, NULL);
+		maxfd = transact_fds(&readfds, (sc > client_socket) ? sc : client_socket);
+		ret = select(maxfd+1, &readfds, NULL, NULL, transact_timeout(&timeout));
 
 		if(ret < 0) {
 			PRINT_ERROR("Error in select()\n")
@@ -82,45 +172,85 @@ void state_bcm() {
 		}
 	}
 
+	transact_process(&readfds);
+
 	if (FD_ISSET(sc, &readfds)) {
 
-		ret = recvfrom(sc, &msg, sizeof(msg), 0,
-			       (struct sockaddr*)&caddr, &caddrlen);
+		iov.iov_base = &msg;
+		iov.iov_len = sizeof(msg);
+		rxhdr.msg_name = &caddr;
+		rxhdr.msg_namelen = caddrlen;
+		rxhdr.msg_iov = &iov;
+		rxhdr.msg_iovlen = 1;
+		rxhdr.msg_control = &ctrlmsg;
+		rxhdr.msg_controllen = sizeof(ctrlmsg);
+		rxhdr.msg_flags = 0;
+
+		ret = recvmsg(sc, &rxhdr, 0);
 
 		/* read timestamp data */
-		if(ioctl(sc, SIOCGSTAMP, &tv) < 0) {
-			PRINT_ERROR("Could not receive timestamp\n");
-		}
+		timestamp_read(&rxhdr, &ts);
+
+		bus = bus_by_ifindex(caddr.can_ifindex);
+
+		/* tell the client about messages lost before this one */
+		i = rxqueue_drops(&rxhdr, &sc_drops);
+		if(i)
+			rxqueue_report(-1, i);
+
+		/* tag the message with its bus if the client asked for bus tags */
+		bus_prefix(rxmsg, bus);
 
+		/* Check if a monitored message is missing */
+		if(msg.msg_head.opcode == RX_TIMEOUT) {
+			if(msg.msg_head.can_id & CAN_EFF_FLAG) {
+				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "timeout %08X ",
+					 msg.msg_head.can_id & CAN_EFF_MASK);
+			} else {
+				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "timeout %03X ",
+					 msg.msg_head.can_id & CAN_SFF_MASK);
+			}
+			timestamp_format(rxmsg + strlen(rxmsg), &ts);
+			snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), ">");
+			send(client_socket, rxmsg, strlen(rxmsg), 0);
 		/* Check if this is an error frame */
-		if(msg.msg_head.can_id & CAN_ERR_FLAG) {
+		} else if(msg.msg_head.can_id & CAN_ERR_FLAG) {
 			if(msg.frame.can_dlc != CAN_ERR_DLC) {
-				PRINT_ERROR("Error frame has a wrong DLC!\n")
-					} else {
-				snprintf(rxmsg, RXLEN, "< error %03X %ld.%06ld ", msg.msg_head.can_id, tv.tv_sec, tv.tv_usec);
+				PRINT_ERROR_RATELIMITED("Error frame has a wrong DLC!\n");
+			} else {
+				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "error %03X ", msg.msg_head.can_id);
+				timestamp_format(rxmsg + strlen(rxmsg), &ts);
 
 				for ( i = 0; i < msg.frame.can_dlc; i++)
 					snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "%02X ",
 						 msg.frame.data[i]);
 
 				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), " >");
-				send(client_socket, rxmsg, strlen(rxmsg), 0);
+				ret = send(client_socket, rxmsg, strlen(rxmsg), 0);
+				METRIC_SEND(ret, strlen(rxmsg));
 			}
 		} else {
+			METRIC_BUS_ADD(frames_rx, bus, 1);
+			PROBE5(frame_rx, bus, msg.msg_head.can_id, msg.frame.can_dlc, ts.tv_sec, ts.tv_nsec);
+
 			if(msg.msg_head.can_id & CAN_EFF_FLAG) {
-				snprintf(rxmsg, RXLEN, "< frame %08X %ld.%06ld ",
-					 msg.msg_head.can_id & CAN_EFF_MASK, tv.tv_sec, tv.tv_usec);
+				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "frame %08X ",
+					 msg.msg_head.can_id & CAN_EFF_MASK);
 			} else {
-				snprintf(rxmsg, RXLEN, "< frame %03X %ld.%06ld ",
-					 msg.msg_head.can_id & CAN_SFF_MASK, tv.tv_sec, tv.tv_usec);
+				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "frame %03X ",
+					 msg.msg_head.can_id & CAN_SFF_MASK);
 			}
+			timestamp_format(rxmsg + strlen(rxmsg), &ts);
 
 			for ( i = 0; i < msg.frame.can_dlc; i++)
 				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "%02X ",
 					 msg.frame.data[i]);
 
 			snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), " >");
-			send(client_socket, rxmsg, strlen(rxmsg), 0);
+			PROBE4(frame_format, bus, msg.msg_head.can_id, rxmsg, strlen(rxmsg));
+			ret = latency_send(bus, rxmsg, strlen(rxmsg), &ts);
+			METRIC_SEND(ret, strlen(rxmsg));
+			PROBE3(client_send, bus, strlen(rxmsg), ret);
 		}
 	}
 
@@ -129,6 +259,10 @@ void state_bcm() {
 
 		ret = receive_command(client_socket, buf);
 
+		/* only acknowledgement timestamps were pending */
+		if(ret > 0)
+			return;
+
 		if(ret != 0) {
 			state = STATE_SHUTDOWN;
 			return;
@@ -138,10 +272,11 @@ void state_bcm() {
 		memset(&msg, 0, sizeof(msg));
 		msg.msg_head.nframes = 1;
 
-		strncpy(ifr.ifr_name, bus_name, IFNAMSIZ);
+		strncpy(ifr.ifr_name, busses[current_bus].name, IFNAMSIZ);
 
 		if (state_changed(buf, state)) {
 			close(sc);
+			transact_close();
 			strcpy(buf, "< ok >");
 			send(client_socket, buf, strlen(buf), 0);
 			return;
@@ -152,6 +287,48 @@ void state_bcm() {
 			return;
 		}
 
+		if(!strncmp("< timestamp ", buf, 12)) {
+			if(timestamp_command(buf) == 0)
+				timestamp_enable(sc);
+			return;
+		}
+
+		if(!strncmp("< latency ", buf, 10)) {
+			latency_command(buf);
+			return;
+		}
+
+		if(!strncmp("< rcvbuf ", buf, 9)) {
+			if(rxqueue_command(buf) == 0)
+				rxqueue_setup(sc, -1);
+			return;
+		}
+
+		if(bus_tags_command(buf))
+			return;
+
+		/* the BCM socket is not bound to a device and serves all busses */
+		if(!strncmp("< open ", buf, 7)) {
+			if(open_bus(buf) < 0) {
+				strcpy(buf, "< error could not open bus >");
+			} else {
+				/* the new bus may need a larger receive buffer */
+				rxqueue_setup(sc, -1);
+				strcpy(buf, "< ok >");
+			}
+			send(client_socket, buf, strlen(buf), 0);
+			return;
+		}
+
+		/* Send a request and wait for its response */
+		if(!strncmp("< transact ", buf, 11)) {
+			if(transact_command(buf) < 0) {
+				strcpy(buf, "< error could not start transaction >");
+				send(client_socket, buf, strlen(buf), 0);
+			}
+			return;
+		}
+
 		/* Send a single frame */
 		if(!strncmp("< send ", buf, 7)) {
 			items = sscanf(buf, "< %*s %x %hhu "
@@ -171,8 +348,9 @@ void state_bcm() {
 			if ( (items < 2) ||
 			     (msg.frame.can_dlc > 8) ||
 			     (items != 2 + msg.frame.can_dlc)) {
-				PRINT_ERROR("Syntax error in send command\n")
-					return;
+				METRIC_INC(parse_errors);
+				PRINT_ERROR_RATELIMITED("Syntax error in send command\n");
+				return;
 			}
 
 			/* < send XXXXXXXX ... > check for extended identifier */
@@ -184,8 +362,10 @@ void state_bcm() {
 
 			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
 				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
+				ret = sendto(sc, &msg, sizeof(msg), 0,
+					     (struct sockaddr*)&caddr, sizeof(caddr));
+				METRIC_BUS_ADD(frames_tx, current_bus, 1);
+				PROBE4(frame_tx, current_bus, msg.frame.can_id, msg.frame.can_dlc, ret);
 			}
 			/* Add a send job */
 		} else if(!strncmp("< add ", buf, 6)) {
@@ -208,6 +388,7 @@ void state_bcm() {
 			if( (items < 4) ||
 			    (msg.frame.can_dlc > 8) ||
 			    (items != 4 + msg.frame.can_dlc) ) {
+				METRIC_INC(parse_errors);
 				PRINT_ERROR("Syntax error in add command.\n");
 				return;
 			}
@@ -225,6 +406,54 @@ void state_bcm() {
 				sendto(sc, &msg, sizeof(msg), 0,
 				       (struct sockaddr*)&caddr, sizeof(caddr));
 			}
+			/* Add a send job cycling through a sequence of frames */
+		} else if(!strncmp("< addseq ", buf, 9)) {
+			memset(&seqmsg.msg_head, 0, sizeof(seqmsg.msg_head));
+
+			items = sscanf(buf, "< %*s %u %lu %lu %lu %lu %x %hhu ",
+				       &seqmsg.msg_head.count,
+				       &seqmsg.msg_head.ival1.tv_sec,
+				       &seqmsg.msg_head.ival1.tv_usec,
+				       &seqmsg.msg_head.ival2.tv_sec,
+				       &seqmsg.msg_head.ival2.tv_usec,
+				       &seqmsg.msg_head.can_id,
+				       &seqmsg.frames[0].can_dlc);
+
+			if( (items != 7) ||
+			    (seqmsg.frames[0].can_dlc > 8) ) {
+				METRIC_INC(parse_errors);
+				PRINT_ERROR("Syntax error in addseq command.\n");
+				return;
+			}
+
+			/* < addseq count sec usec sec usec XXXXXXXX ... > check for extended identifier */
+			if(element_length(buf, 7) == 8)
+				seqmsg.msg_head.can_id |= CAN_EFF_FLAG;
+
+			items = parse_frame_sequence(buf, 9, seqmsg.msg_head.can_id,
+						     seqmsg.frames[0].can_dlc);
+
+			/* frames without data need no data element */
+			if(items == 0 && seqmsg.frames[0].can_dlc == 0) {
+				seqmsg.frames[0].can_id = seqmsg.msg_head.can_id;
+				items = 1;
+			}
+
+			if(items <= 0) {
+				METRIC_INC(parse_errors);
+				PRINT_ERROR("Syntax error in addseq command.\n");
+				return;
+			}
+
+			seqmsg.msg_head.opcode = TX_SETUP;
+			seqmsg.msg_head.flags = SETTIMER | STARTTIMER;
+			seqmsg.msg_head.nframes = items;
+
+			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
+				caddr.can_ifindex = ifr.ifr_ifindex;
+				sendto(sc, &seqmsg, sizeof(seqmsg.msg_head) + items * sizeof(struct can_frame), 0,
+				       (struct sockaddr*)&caddr, sizeof(caddr));
+			}
 			/* Update send job */
 		} else if(!strncmp("< update ", buf, 9)) {
 			items = sscanf(buf, "< %*s %x %hhu "
@@ -244,6 +473,7 @@ void state_bcm() {
 			if ( (items < 2) ||
 			     (msg.frame.can_dlc > 8) ||
 			     (items != 2 + msg.frame.can_dlc)) {
+				METRIC_INC(parse_errors);
 				PRINT_ERROR("Syntax error in update send job command\n")
 					return;
 			}
@@ -267,6 +497,7 @@ void state_bcm() {
 				       &msg.msg_head.can_id);
 
 			if (items != 1)  {
+				METRIC_INC(parse_errors);
 				PRINT_ERROR("Syntax error in delete job command\n")
 					return;
 			}
@@ -301,19 +532,25 @@ void state_bcm() {
 				       &msg.frame.data[6],
 				       &msg.frame.data[7]);
 
+			/* an optional timeout may follow the data bytes */
 			if( (items < 4) ||
 			    (msg.frame.can_dlc > 8) ||
-			    (items != 4 + msg.frame.can_dlc) ) {
+			    (items < 4 + msg.frame.can_dlc) ||
+			    (parse_rx_timeout(buf, 6 + msg.frame.can_dlc, &msg.msg_head, &i) < 0) ) {
+				METRIC_INC(parse_errors);
 				PRINT_ERROR("syntax error in filter command.\n")
 					return;
 			}
 
+			/* elements of the timeout may have been read as data bytes */
+			memset(msg.frame.data + msg.frame.can_dlc, 0, 8 - msg.frame.can_dlc);
+
 			/* < filter sec usec XXXXXXXX ... > check for extended identifier */
 			if(element_length(buf, 4) == 8)
 				msg.msg_head.can_id |= CAN_EFF_FLAG;
 
 			msg.msg_head.opcode = RX_SETUP;
-			msg.msg_head.flags  = SETTIMER;
+			msg.msg_head.flags |= SETTIMER;
 			msg.frame.can_id = msg.msg_head.can_id;
 
 			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
@@ -321,14 +558,56 @@ void state_bcm() {
 				sendto(sc, &msg, sizeof(msg), 0,
 				       (struct sockaddr*)&caddr, sizeof(caddr));
 			}
+			/* Receive multiplexed CAN ID with content matching per mux value */
+		} else if(!strncmp("< muxfilter ", buf, 12)) {
+			memset(&seqmsg.msg_head, 0, sizeof(seqmsg.msg_head));
+
+			items = sscanf(buf, "< %*s %lu %lu %x %hhu ",
+				       &seqmsg.msg_head.ival2.tv_sec,
+				       &seqmsg.msg_head.ival2.tv_usec,
+				       &seqmsg.msg_head.can_id,
+				       &seqmsg.frames[0].can_dlc);
+
+			if( (items != 4) ||
+			    (seqmsg.frames[0].can_dlc > 8) ) {
+				METRIC_INC(parse_errors);
+				PRINT_ERROR("syntax error in muxfilter command.\n")
+					return;
+			}
+
+			/* < muxfilter sec usec XXXXXXXX ... > check for extended identifier */
+			if(element_length(buf, 4) == 8)
+				seqmsg.msg_head.can_id |= CAN_EFF_FLAG;
+
+			/* the mux mask followed by at least one mask per mux value */
+			items = parse_frame_sequence(buf, 6, seqmsg.msg_head.can_id,
+						     seqmsg.frames[0].can_dlc);
+
+			if(items < 2) {
+				METRIC_INC(parse_errors);
+				PRINT_ERROR("syntax error in muxfilter command.\n")
+					return;
+			}
+
+			seqmsg.msg_head.opcode = RX_SETUP;
+			seqmsg.msg_head.flags  = SETTIMER;
+			seqmsg.msg_head.nframes = items;
+
+			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
+				caddr.can_ifindex = ifr.ifr_ifindex;
+				sendto(sc, &seqmsg, sizeof(seqmsg.msg_head) + items * sizeof(struct can_frame), 0,
+				       (struct sockaddr*)&caddr, sizeof(caddr));
+			}
 			/* Add a filter */
 		} else if(!strncmp("< subscribe ", buf, 12)) {
-			items = sscanf(buf, "< %*s %lu %lu %x >",
+			items = sscanf(buf, "< %*s %lu %lu %x ",
 				       &msg.msg_head.ival2.tv_sec,
 				       &msg.msg_head.ival2.tv_usec,
 				       &msg.msg_head.can_id);
 
-			if (items != 3) {
+			if ( (items != 3) ||
+			     (parse_rx_timeout(buf, 5, &msg.msg_head, &i) < 0) ) {
+				METRIC_INC(parse_errors);
 				PRINT_ERROR("syntax error in subscribe command\n")
 					return;
 			}
@@ -338,9 +617,18 @@ void state_bcm() {
 				msg.msg_head.can_id |= CAN_EFF_FLAG;
 
 			msg.msg_head.opcode = RX_SETUP;
-			msg.msg_head.flags  = RX_FILTER_ID | SETTIMER;
 			msg.frame.can_id = msg.msg_head.can_id;
 
+			/*
+			 * With 'resume' only the liveness of the CAN ID is of interest:
+			 * the empty content mask reports the first frame and every
+			 * frame after a timeout but no further frames.
+			 */
+			if(i)
+				msg.msg_head.flags |= SETTIMER;
+			else
+				msg.msg_head.flags |= RX_FILTER_ID | SETTIMER;
+
 			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
 				caddr.can_ifindex = ifr.ifr_ifindex;
 				sendto(sc, &msg, sizeof(msg), 0,
@@ -352,6 +640,7 @@ void state_bcm() {
 				       &msg.msg_head.can_id);
 
 			if (items != 1) {
+				METRIC_INC(parse_errors);
 				PRINT_ERROR("syntax error in unsubscribe command\n")
 					return;
 			}
@@ -369,6 +658,7 @@ void state_bcm() {
 				       (struct sockaddr*)&caddr, sizeof(caddr));
 			}
 		} else {
+			METRIC_INC(parse_errors);
 			PRINT_ERROR("unknown command '%s'.\n", buf)
 				strcpy(buf, "< error unknown command >");
 			send(client_socket, buf, strlen(buf), 0);
@@ -1,12 +1,15 @@
 #include "config.h"
 #include "socketcand.h"
 #include "statistics.h"
+#include "busload.h"
+#include "census.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <pthread.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -17,19 +20,58 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+static fd_set readfds;
+
 void state_control() {
 	char buf[MAXLEN];
-	int i, items;
+	int i, items, maxfd, ret;
 
 	if(previous_state != STATE_CONTROL) {
-		PRINT_VERBOSE("starting statistics thread...\n")
-			pthread_create(&statistics_thread, NULL, &statistics_loop, NULL);
-
+		/* continue the statistics of a previous visit of control mode */
+		statistics_start(statistics_ival);
 		previous_state = STATE_CONTROL;
 	}
 
+	FD_ZERO(&readfds);
+	FD_SET(client_socket, &readfds);
+	maxfd = client_socket;
+
+	/*
+	 * Check if there are more elements in the element buffer before calling select() and
+	 * blocking for the statistics timer.
+	 */
+	if(!more_elements) {
+		if(statistics_fd() >= 0) {
+			FD_SET(statistics_fd(), &readfds);
+			if(statistics_fd() > maxfd)
+				maxfd = statistics_fd();
+		}
+		maxfd = busload_fds(&readfds, maxfd);
+		maxfd = census_fds(&readfds, maxfd);
+
+		ret = select(maxfd+1, &readfds, NULL, NULL, NULL);
+		if(ret < 0) {
+			PRINT_ERROR("Error in select()\n")
+				state = STATE_SHUTDOWN;
+			return;
+		}
+
+		busload_process(&readfds);
+		census_process(&readfds);
+
+		if(statistics_fd() >= 0 && FD_ISSET(statistics_fd(), &readfds))
+			statistics_send();
+
+		if(!FD_ISSET(client_socket, &readfds))
+			return;
+	}
+
 	i = receive_command(client_socket, (char *) &buf);
 
+	/* only acknowledgement timestamps were pending */
+	if(i > 0)
+		return;
+
 	if(i != 0) {
 		PRINT_ERROR("Connection terminated while waiting for command.\n");
 		state = STATE_SHUTDOWN;
@@ -37,7 +79,8 @@ void state_control() {
 	}
 
 	if (state_changed(buf, state)) {
-		pthread_cancel(statistics_thread);
+		statistics_stop();
+		census_stop();
 		strcpy(buf, "< ok >");
 		send(client_socket, buf, strlen(buf), 0);
 		return;
@@ -48,16 +91,52 @@ void state_control() {
 		return;
 	}
 
+	/* latency histograms of all connections */
+	if(!strcmp("< latency >", buf)) {
+		latency_report();
+		return;
+	}
+
+	/* metrics of all connections in the Prometheus text format */
+	if(!strcmp("< metrics >", buf)) {
+		char *text;
+		size_t len;
+
+		text = metrics_format(&len);
+		if(!text) {
+			strcpy(buf, "< error metrics not available >");
+			send(client_socket, buf, strlen(buf), 0);
+			return;
+		}
+
+		send(client_socket, "< metrics\n", 10, MSG_MORE);
+		send(client_socket, text, len, MSG_MORE);
+		send(client_socket, ">", 1, 0);
+		free(text);
+		return;
+	}
+
+	/* table of the CAN IDs seen on the busses */
+	if(!strncmp("< census ", buf, 9)) {
+		if(census_command(buf) < 0) {
+			strcpy(buf, "< error census command failed >");
+			send(client_socket, buf, strlen(buf), 0);
+		}
+		return;
+	}
+
 	if(!strncmp("< statistics ", buf, 13)) {
 		items = sscanf(buf, "< %*s %u >",
 			       &i);
 
 		if (items != 1) {
+			METRIC_INC(parse_errors);
 			PRINT_ERROR("Syntax error in statistics command\n")
 				} else {
-			statistics_ival = i;
+			statistics_start(i);
 		}
 	} else {
+		METRIC_INC(parse_errors);
 		PRINT_ERROR("unknown command '%s'.\n", buf)
 			strcpy(buf, "< error unknown command >");
 		send(client_socket, buf, strlen(buf), 0);
@@ -1,11 +1,18 @@
 #include "config.h"
 #include "socketcand.h"
+#include "timestamp.h"
+#include "rxqueue.h"
+#include "flash.h"
+#include "metrics.h"
+#include "probes.h"
+#include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -21,178 +28,748 @@
 #include <linux/can/isotp.h>
 #include <linux/can/error.h>
 
-int si = -1;
-fd_set readfds;
+#define MAX_ISOTP_CHANNELS 64
+#define ISOTP_TXQUEUE_LEN 64
+#define ISOTP_MAX_PDU (1 << 24)
+#define ISOTP_HEXBLOCK 512 /* PDU bytes converted to hex at once */
+
+/* a PDU waiting for transmission */
+struct isotp_pdu {
+	struct isotp_pdu *next;
+	int len;
+	unsigned char data[];
+};
+
+/* an ISO-TP channel configured by the client */
+struct isotp_channel {
+	int socket; /* -1 if the channel is not configured */
+	int bus;
+	int tagged; /* opened with isotpopen, PDUs carry the channel handle */
+	__u32 drops;
+	int tx_busy; /* a PDU was handed to the kernel and is being sent */
+	int tx_wait; /* PDUs are sent blocking, see isotp_poll_broken */
+	int tx_count;
+	struct isotp_pdu *tx_head, *tx_tail;
+	int pdu_size; /* maximum PDU length of the channel */
+	unsigned char *rx_buf; /* allocated on the first reception */
+	unsigned char *tx_part; /* PDU collected from pdupart commands */
+	int tx_part_len;
+	struct flash_job flash; /* download running on the channel */
+};
+
+static struct isotp_channel channels[MAX_ISOTP_CHANNELS];
+
+/*
+ * The isotp module reports a socket as writable while a PDU is still sent.
+ * Only kernels with the poll handler of isotp (Linux 6.1 and its stable
+ * backports) signal the end of a transmission that way.
+ */
+static int isotp_poll_broken = 0;
+static fd_set readfds, writefds;
+
+/* tell the client about the end of a download */
+static void isotp_flash_done(int ch, int status) {
+	struct flash_job *job = &channels[ch].flash;
+	char buf[64];
+	int len;
+
+	if(job->state != FLASH_IDLE)
+		flash_finish(job, status);
+	else
+		job->status = status;
+
+	len = bus_prefix(buf, channels[ch].bus);
+	if(job->status == FLASH_NEGATIVE_RESPONSE)
+		sprintf(buf + len, "flashdone %d %d %02X >", ch, job->status, job->nrc);
+	else
+		sprintf(buf + len, "flashdone %d %d >", ch, job->status);
+	send(client_socket, buf, strlen(buf), 0);
+}
 
-void state_isotp() {
-	int i, items, ret;
+/* tell the client that a PDU of a tagged channel was sent or failed */
+static void isotp_tx_done(int ch, int status) {
+	char buf[64];
+	int len;
+
+	if(status)
+		PRINT_ERROR_RATELIMITED("Error sending PDU on channel %d: %s\n", ch, strerror(status));
+
+	/* requests of a download are not reported to the client */
+	if(channels[ch].flash.state != FLASH_IDLE) {
+		if(status)
+			isotp_flash_done(ch, FLASH_TX_ERROR);
+		else
+			flash_sent(&channels[ch].flash);
+		return;
+	}
 
-	struct sockaddr_can addr;
-	struct ifreq ifr;
-	static struct can_isotp_options opts;
-	static struct can_isotp_fc_options fcopts;
+	if(!channels[ch].tagged)
+		return;
 
-	char rxmsg[MAXLEN]; /* can to inet */
-	char buf[MAXLEN]; /* inet commands to can */
-	unsigned char isobuf[ISOTPLEN+1]; /* binary buffer for isotp socket */
-	unsigned char tmp;
-	
-	while(previous_state != STATE_ISOTP) {
+	len = bus_prefix(buf, channels[ch].bus);
+	sprintf(buf + len, "pdusent %d %d >", ch, status);
+	send(client_socket, buf, strlen(buf), 0);
+}
 
-		ret = receive_command(client_socket, buf);
-		if(ret != 0) {
-			state = STATE_SHUTDOWN;
+/*
+ * Wait until the PDU in transmission is done. A send() without data waits
+ * for the idle socket like any other send() and then fails with EINVAL.
+ */
+static void isotp_tx_wait(int ch) {
+	while(send(channels[ch].socket, NULL, 0, 0) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Hand queued PDUs to the kernel without blocking. The ISO-TP socket only
+ * takes a new PDU when the previous one was sent completely, which is
+ * signalled by the socket becoming writable again. Without the poll handler
+ * of isotp the PDUs are sent blocking instead.
+ */
+static void isotp_tx_kick(int ch) {
+	struct isotp_channel *c = &channels[ch];
+	struct isotp_pdu *pdu;
+	int ret, err;
+	socklen_t errlen = sizeof(err);
+
+	if(c->tx_busy) {
+		/* an empty PDU is refused with EINVAL by an idle socket only */
+		if(send(c->socket, NULL, 0, MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+			if(!isotp_poll_broken) {
+				PRINT_ERROR("The isotp module does not signal sent PDUs, they are sent blocking\n");
+			}
+			isotp_poll_broken = 1;
+			c->tx_wait = 1;
+			isotp_tx_wait(ch);
+		}
+
+		/* the previous PDU is done, errors like a missing FC are in SO_ERROR */
+		err = 0;
+		getsockopt(c->socket, SOL_SOCKET, SO_ERROR, &err, &errlen);
+		c->tx_busy = 0;
+		isotp_tx_done(ch, err);
+	}
+
+	while((pdu = c->tx_head)) {
+		ret = send(c->socket, pdu->data, pdu->len, c->tx_wait ? 0 : MSG_DONTWAIT);
+		PROBE3(pdu_tx, ch, pdu->len, ret);
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
 			return;
+
+		c->tx_head = pdu->next;
+		if(!c->tx_head)
+			c->tx_tail = NULL;
+		c->tx_count--;
+		METRIC_ADD(tx_queue, -1);
+		free(pdu);
+
+		if(ret >= 0 && c->tx_wait) {
+			/* sockets opened before the detection have no CAN_ISOTP_WAIT_TX_DONE */
+			isotp_tx_wait(ch);
+			err = 0;
+			getsockopt(c->socket, SOL_SOCKET, SO_ERROR, &err, &errlen);
+			isotp_tx_done(ch, err);
+			continue;
 		}
 
-		strncpy(ifr.ifr_name, bus_name, IFNAMSIZ);
+		if(ret >= 0) {
+			c->tx_busy = 1;
+			return;
+		}
 
-		if (state_changed(buf, state)) {
-			/* ensure proper handling in other states */
-			previous_state = STATE_ISOTP;
-			strcpy(buf, "< ok >");
+		isotp_tx_done(ch, errno);
+	}
+}
+
+/* queue a PDU and send it right away if the channel is idle */
+static void isotp_queue(int ch, struct isotp_pdu *pdu) {
+	struct isotp_channel *c = &channels[ch];
+
+	pdu->next = NULL;
+	if (c->tx_tail)
+		c->tx_tail->next = pdu;
+	else
+		c->tx_head = pdu;
+	c->tx_tail = pdu;
+	c->tx_count++;
+	METRIC_INC(tx_queue);
+
+	if (!c->tx_busy)
+		isotp_tx_kick(ch);
+}
+
+/* queue the next request of the download running on a channel */
+static void isotp_flash_request(int ch) {
+	struct flash_job *job = &channels[ch].flash;
+	struct isotp_pdu *pdu;
+
+	pdu = malloc(sizeof(*pdu) + flash_request_size(job));
+	if (!pdu) {
+		PRINT_ERROR("Could not allocate PDU\n");
+		isotp_flash_done(ch, FLASH_IMAGE_ERROR);
+		return;
+	}
+
+	pdu->len = flash_request(job, pdu->data);
+	if (pdu->len < 0) {
+		PRINT_ERROR("Could not read flash image\n");
+		free(pdu);
+		isotp_flash_done(ch, FLASH_IMAGE_ERROR);
+		return;
+	}
+
+	isotp_queue(ch, pdu);
+}
+
+/* pass a response of the ECU to the download running on a channel */
+static void isotp_flash_response(int ch, unsigned char *data, int len) {
+	struct flash_job *job = &channels[ch].flash;
+	size_t sent = job->sent;
+	char buf[64];
+	int ret;
+
+	switch (flash_response(job, data, len)) {
+	case FLASH_SEND:
+		if (job->sent != sent) {
+			ret = bus_prefix(buf, channels[ch].bus);
+			sprintf(buf + ret, "flashprogress %d %zu %zu >", ch, job->sent, job->image_len);
 			send(client_socket, buf, strlen(buf), 0);
+		}
+		isotp_flash_request(ch);
+		break;
+	case FLASH_DONE:
+		isotp_flash_done(ch, job->status);
+		break;
+	}
+}
+
+static void isotp_close(int ch) {
+	struct isotp_pdu *pdu;
+
+	if(channels[ch].socket >= 0) {
+		close(channels[ch].socket);
+		channels[ch].socket = -1;
+	}
+
+	while((pdu = channels[ch].tx_head)) {
+		channels[ch].tx_head = pdu->next;
+		free(pdu);
+	}
+	channels[ch].tx_tail = NULL;
+	METRIC_ADD(tx_queue, -channels[ch].tx_count);
+	channels[ch].tx_count = 0;
+	channels[ch].tx_busy = 0;
+
+	free(channels[ch].rx_buf);
+	channels[ch].rx_buf = NULL;
+	free(channels[ch].tx_part);
+	channels[ch].tx_part = NULL;
+	channels[ch].tx_part_len = 0;
+
+	flash_reset(&channels[ch].flash);
+}
+
+/*
+ * Open the ISO-TP socket of a channel on the currently selected bus. The
+ * configuration 'tx_id rx_id flags blocksize stmin [...]' starts at the
+ * given element of the command. Returns -1 on errors.
+ */
+static int isotp_open(int ch, char *buf, int element) {
+	int items, si;
+	char *conf = element_start(buf, element);
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	struct can_isotp_options opts;
+	struct can_isotp_fc_options fcopts;
+
+	memset(&opts, 0, sizeof(opts));
+	memset(&fcopts, 0, sizeof(fcopts));
+	memset(&addr, 0, sizeof(addr));
+
+	if(!conf) {
+		METRIC_INC(parse_errors);
+		PRINT_ERROR("Syntax error in isotpconf command\n");
+		return -1;
+	}
+
+	items = sscanf(conf, "%x %x %x "
+		       "%hhu %hhx %hhu "
+		       "%hhx %hhx %hhx %hhx >",
+		       &addr.can_addr.tp.tx_id,
+		       &addr.can_addr.tp.rx_id,
+		       &opts.flags,
+		       &fcopts.bs,
+		       &fcopts.stmin,
+		       &fcopts.wftmax,
+		       &opts.txpad_content,
+		       &opts.rxpad_content,
+		       &opts.ext_address,
+		       &opts.rx_ext_address);
+
+	/* < isotpconf XXXXXXXX ... > check for extended identifier */
+	if(element_length(buf, element) == 8)
+		addr.can_addr.tp.tx_id |= CAN_EFF_FLAG;
+
+	if(element_length(buf, element + 1) == 8)
+		addr.can_addr.tp.rx_id |= CAN_EFF_FLAG;
+
+	if ((opts.flags & CAN_ISOTP_RX_EXT_ADDR && items < 10) ||
+	    (opts.flags & CAN_ISOTP_EXTEND_ADDR && items < 9) ||
+	    (opts.flags & CAN_ISOTP_RX_PADDING && items < 8) ||
+	    (opts.flags & CAN_ISOTP_TX_PADDING && items < 7) ||
+	    (items < 5)) {
+		METRIC_INC(parse_errors);
+		PRINT_ERROR("Syntax error in isotpconf command\n");
+		return -1;
+	}
+
+	/* a channel may be reconfigured at any time */
+	isotp_close(ch);
+
+	/* open ISOTP socket */
+	if ((si = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP)) < 0) {
+		PRINT_ERROR("Error while opening ISOTP socket %s\n", strerror(errno));
+		return -1;
+	}
+
+	strcpy(ifr.ifr_name, busses[current_bus].name);
+	if(ioctl(si, SIOCGIFINDEX, &ifr) < 0) {
+		PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
+		close(si);
+		return -1;
+	}
+
+	addr.can_family = PF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+
+	/* the transmit queue relies on non-blocking writes if poll() tells the end of a PDU */
+	if(isotp_poll_broken)
+		opts.flags |= CAN_ISOTP_WAIT_TX_DONE;
+	else
+		opts.flags &= ~CAN_ISOTP_WAIT_TX_DONE;
+
+	/* only change the built-in defaults when required */
+	if (opts.flags)
+		setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts));
+
+	setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fcopts, sizeof(fcopts));
+
+	if(timestamp_enable(si) < 0 || rxqueue_setup(si, current_bus) < 0) {
+		close(si);
+		return -1;
+	}
+
+	PRINT_VERBOSE("binding ISOTP socket...\n")
+	if (bind(si, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		PRINT_ERROR("Error while binding ISOTP socket %s\n", strerror(errno));
+		close(si);
+		return -1;
+	}
+
+	/* ok we made it and have a proper isotp socket open */
+	channels[ch].socket = si;
+	channels[ch].pdu_size = ISOTPLEN;
+	channels[ch].bus = current_bus;
+	channels[ch].drops = 0;
+	channels[ch].tx_wait = isotp_poll_broken;
+
+	return 0;
+}
+
+/*
+ * Send '< head hexdata >' to the client. The hex data is converted in small
+ * blocks and the message is passed to the socket in several send() calls
+ * so that no buffer for the complete message is needed.
+ */
+static void isotp_send_message(char *head, unsigned char *data, int len) {
+	char hex[2 * ISOTP_HEXBLOCK + 1];
+	int i, n;
+
+	send(client_socket, head, strlen(head), MSG_MORE);
+
+	while (len > 0) {
+		n = (len > ISOTP_HEXBLOCK) ? ISOTP_HEXBLOCK : len;
+		for (i=0; i < n; i++)
+			sprintf(hex + 2*i, "%02X", data[i]);
+		data += n;
+		len -= n;
+
+		send(client_socket, hex, 2*n, MSG_MORE);
+	}
+
+	METRIC_SEND(send(client_socket, " >", 2, 0), 2);
+}
+
+/* forward a received PDU from one of the channels to the client */
+static void isotp_receive(int ch) {
+	int items, offset, startlen;
+	char head[64];
+	struct isotp_channel *c = &channels[ch];
+	struct timespec ts;
+	struct iovec iov;
+	struct msghdr msg;
+	char ctrlmsg[TIMESTAMP_CTRLLEN + RXQUEUE_CTRLLEN];
+	__u32 drops;
+
+	/* the receive buffer follows the PDU size configured for the channel */
+	if (!c->rx_buf) {
+		c->rx_buf = malloc(c->pdu_size);
+		if (!c->rx_buf) {
+			PRINT_ERROR("Could not allocate receive buffer\n");
 			return;
 		}
+	}
 
-		if(!strcmp("< echo >", buf)) {
-			send(client_socket, buf, strlen(buf), 0);
-			continue;
+	iov.iov_base = c->rx_buf;
+	iov.iov_len = c->pdu_size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &ctrlmsg;
+	msg.msg_controllen = sizeof(ctrlmsg);
+
+	items = recvmsg(c->socket, &msg, 0);
+
+	/* read timestamp data */
+	timestamp_read(&msg, &ts);
+
+	/* tell the client about PDUs lost before this one */
+	drops = rxqueue_drops(&msg, &c->drops);
+	if(drops)
+		rxqueue_report(c->bus, drops);
+
+	if (msg.msg_flags & MSG_TRUNC) {
+		PRINT_ERROR_RATELIMITED("PDU on channel %d exceeds %d bytes\n", ch, c->pdu_size);
+		return;
+	}
+
+	if (items <= 0)
+		return;
+
+	PROBE4(pdu_rx, ch, items, ts.tv_sec, ts.tv_nsec);
+
+	/* responses to a running download are not forwarded */
+	if (c->flash.state != FLASH_IDLE) {
+		isotp_flash_response(ch, c->rx_buf, items);
+		return;
+	}
+
+	/* PDUs longer than ISOTPLEN are streamed in parts of ISOTPLEN bytes */
+	for (offset = 0; items - offset > ISOTPLEN; offset += ISOTPLEN) {
+		startlen = bus_prefix(head, c->bus);
+		if(c->tagged)
+			sprintf(head + startlen, "pdupart %d ", ch);
+		else
+			sprintf(head + startlen, "pdupart ");
+		isotp_send_message(head, c->rx_buf + offset, ISOTPLEN);
+	}
+
+	startlen = bus_prefix(head, c->bus);
+	if(c->tagged)
+		startlen += sprintf(head + startlen, "pdu %d ", ch);
+	else
+		startlen += sprintf(head + startlen, "pdu ");
+	timestamp_format(head + startlen, &ts);
+
+	isotp_send_message(head, c->rx_buf + offset, items - offset);
+}
+
+/*
+ * Get the channel of '< command [channel] data >'. Without a channel handle
+ * the command refers to the channel configured with isotpconf. element is
+ * set to the data element. Returns -1 for invalid channels.
+ */
+static int isotp_channel(char *buf, int *element) {
+	char *data = element_start(buf, 3);
+	int ch = 0;
+
+	*element = 2;
+
+	/* < command channel data > */
+	if(data && *data != '>') {
+		if(sscanf(buf, "< %*s %d ", &ch) != 1 || ch < 0 || ch >= MAX_ISOTP_CHANNELS) {
+			PRINT_ERROR("invalid ISO-TP channel\n");
+			return -1;
 		}
+		*element = 3;
+	}
 
-		memset(&opts, 0, sizeof(opts));
-		memset(&fcopts, 0, sizeof(fcopts));
-		memset(&addr, 0, sizeof(addr));
+	if(channels[ch].socket < 0) {
+		PRINT_ERROR("ISO-TP channel %d is not configured\n", ch);
+		return -1;
+	}
 
-		/* get configuration to open the socket */
-		if(!strncmp("< isotpconf ", buf, 12)) {
-			items = sscanf(buf, "< %*s %x %x %x "
-				       "%hhu %hhx %hhu "
-				       "%hhx %hhx %hhx %hhx >",
-				       &addr.can_addr.tp.tx_id,
-				       &addr.can_addr.tp.rx_id,
-				       &opts.flags,
-				       &fcopts.bs,
-				       &fcopts.stmin,
-				       &fcopts.wftmax,
-				       &opts.txpad_content,
-				       &opts.rxpad_content,
-				       &opts.ext_address,
-				       &opts.rx_ext_address);
-
-			/* < isotpconf XXXXXXXX ... > check for extended identifier */
-			if(element_length(buf, 2) == 8)
-				addr.can_addr.tp.tx_id |= CAN_EFF_FLAG;
-
-			if(element_length(buf, 3) == 8)
-				addr.can_addr.tp.rx_id |= CAN_EFF_FLAG;
-
-			if ((opts.flags & CAN_ISOTP_RX_EXT_ADDR && items < 10) ||
-			    (opts.flags & CAN_ISOTP_EXTEND_ADDR && items < 9) ||
-			    (opts.flags & CAN_ISOTP_RX_PADDING && items < 8) ||
-			    (opts.flags & CAN_ISOTP_TX_PADDING && items < 7) ||
-			    (items < 5)) {
-				PRINT_ERROR("Syntax error in isotpconf command\n");
-				/* try it once more */
-				continue;
-			}
+	return ch;
+}
 
-			/* open ISOTP socket */
-			if ((si = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP)) < 0) {
-				PRINT_ERROR("Error while opening ISOTP socket %s\n", strerror(errno));
-				/* ensure proper handling in other states */
-				previous_state = STATE_ISOTP;
-				state = STATE_SHUTDOWN;
-				return;
-			}
+/*
+ * Handle '< pdupart [channel] pdudata >' and '< sendpdu [channel] pdudata >'.
+ * Parts are collected until sendpdu completes the PDU, which is then queued
+ * for transmission. Without a channel handle the PDU is sent on the channel
+ * configured with isotpconf.
+ */
+static int isotp_send(char *buf, int complete) {
+	int ch, items, element;
+	struct isotp_channel *c;
+	struct isotp_pdu *pdu;
+	unsigned char *part;
+
+	ch = isotp_channel(buf, &element);
+	if (ch < 0)
+		return 0;
+	c = &channels[ch];
+
+	if (c->flash.state != FLASH_IDLE) {
+		PRINT_ERROR("Channel %d is busy with a download\n", ch);
+		isotp_tx_done(ch, EBUSY);
+		return 0;
+	}
 
-			strcpy(ifr.ifr_name, bus_name);
-			if(ioctl(si, SIOCGIFINDEX, &ifr) < 0) {
-				PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
-				/* ensure proper handling in other states */
-				previous_state = STATE_ISOTP;
-				state = STATE_SHUTDOWN;
-				return;
-			}
+	items = element_length(buf, element);
+	if (items & 1) {
+		PRINT_ERROR("odd number of ASCII Hex values\n");
+		return 0;
+	}
 
-			addr.can_family = PF_CAN;
-			addr.can_ifindex = ifr.ifr_ifindex;
+	if (c->tx_part_len + items / 2 > c->pdu_size) {
+		PRINT_ERROR("PDU too long\n");
+		free(c->tx_part);
+		c->tx_part = NULL;
+		c->tx_part_len = 0;
+		return 0;
+	}
 
-			/* only change the built-in defaults when required */
-			if (opts.flags)
-				setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts));
+	if (!complete) {
+		part = realloc(c->tx_part, c->tx_part_len + items / 2);
+		if (!part) {
+			PRINT_ERROR("Could not allocate PDU\n");
+			return -1;
+		}
+		c->tx_part = part;
 
-			setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fcopts, sizeof(fcopts));
+		if (hex2data(element_start(buf, element), items, c->tx_part + c->tx_part_len) < 0)
+			return 0;
+		c->tx_part_len += items / 2;
+		return 0;
+	}
 
-			PRINT_VERBOSE("binding ISOTP socket...\n")
-			if (bind(si, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-				PRINT_ERROR("Error while binding ISOTP socket %s\n", strerror(errno));
-				/* ensure proper handling in other states */
-				previous_state = STATE_ISOTP;
-				state = STATE_SHUTDOWN;
-				return;
-			}
-			
-			/* ok we made it and have a proper isotp socket open */
-			previous_state = STATE_ISOTP;
+	if (c->tx_count >= ISOTP_TXQUEUE_LEN) {
+		isotp_tx_done(ch, ENOBUFS);
+		return 0;
+	}
+
+	pdu = malloc(sizeof(*pdu) + c->tx_part_len + items / 2);
+	if (!pdu) {
+		PRINT_ERROR("Could not allocate PDU\n");
+		return -1;
+	}
+
+	/* the PDU consists of the collected parts followed by the data */
+	if (c->tx_part_len)
+		memcpy(pdu->data, c->tx_part, c->tx_part_len);
+	pdu->len = hex2data(element_start(buf, element), items, pdu->data + c->tx_part_len);
+
+	free(c->tx_part);
+	c->tx_part = NULL;
+	items = c->tx_part_len;
+	c->tx_part_len = 0;
+
+	if (pdu->len < 0) {
+		free(pdu);
+		return 0;
+	}
+	pdu->len += items;
+
+	isotp_queue(ch, pdu);
+
+	return 0;
+}
+
+/*
+ * Get the timeout for select() from the download that has to receive its
+ * response first. Returns NULL if no download is running.
+ */
+static struct timeval *isotp_flash_timeout(struct timeval *tv) {
+	struct timespec now, *first = NULL;
+	long long usec;
+	int i;
+
+	for(i=0; i < MAX_ISOTP_CHANNELS; i++) {
+		if(channels[i].socket < 0 || channels[i].flash.state == FLASH_IDLE ||
+		   channels[i].flash.sending)
+			continue;
+		if(!first || channels[i].flash.deadline.tv_sec < first->tv_sec ||
+		   (channels[i].flash.deadline.tv_sec == first->tv_sec &&
+		    channels[i].flash.deadline.tv_nsec < first->tv_nsec))
+			first = &channels[i].flash.deadline;
+	}
+
+	if(!first)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (first->tv_sec - now.tv_sec) * 1000000LL + (first->tv_nsec - now.tv_nsec) / 1000;
+	if(usec < 0)
+		usec = 0;
+
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+	return tv;
+}
+
+/* fail downloads whose ECU did not respond in time */
+static void isotp_flash_expire() {
+	struct timespec now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for(i=0; i < MAX_ISOTP_CHANNELS; i++) {
+		if(channels[i].socket < 0 || channels[i].flash.state == FLASH_IDLE ||
+		   channels[i].flash.sending)
+			continue;
+		if(now.tv_sec > channels[i].flash.deadline.tv_sec ||
+		   (now.tv_sec == channels[i].flash.deadline.tv_sec &&
+		    now.tv_nsec >= channels[i].flash.deadline.tv_nsec))
+			isotp_flash_done(i, FLASH_TIMEOUT);
+	}
+}
+
+/*
+ * Handle '< flashdata channel data >', '< flash channel address [file] >'
+ * and '< flashabort channel >'. The channel handle is mandatory.
+ */
+static void isotp_flash_command(char *buf) {
+	unsigned char data[MAXLEN / 2];
+	char file[256];
+	struct isotp_channel *c;
+	unsigned long address;
+	int ch, items, len;
+
+	if(sscanf(buf, "< %*s %d ", &ch) != 1 || ch < 0 || ch >= MAX_ISOTP_CHANNELS ||
+	   channels[ch].socket < 0) {
+		PRINT_ERROR("invalid ISO-TP channel\n");
+		return;
+	}
+	c = &channels[ch];
+
+	if(strncmp("< flashabort ", buf, 13) && c->flash.state != FLASH_IDLE) {
+		PRINT_ERROR("Channel %d is busy with a download\n", ch);
+		return;
+	}
+
+	if(!strncmp("< flashdata ", buf, 12)) {
+		len = element_length(buf, 3);
+		if(len & 1 || (len = hex2data(element_start(buf, 3), len, data)) < 0) {
+			METRIC_INC(parse_errors);
+			PRINT_ERROR("Syntax error in flashdata command\n");
+			return;
 		}
-	} /* while */
+		if(flash_append(&c->flash, data, len) < 0)
+			isotp_flash_done(ch, FLASH_IMAGE_ERROR);
+
+	} else if(!strncmp("< flash ", buf, 8)) {
+		items = sscanf(buf, "< %*s %*d %lx %255s", &address, file);
+		if(items < 1) {
+			METRIC_INC(parse_errors);
+			PRINT_ERROR("Syntax error in flash command\n");
+			return;
+		}
+
+		/* without a file name the image sent with flashdata is used */
+		if(flash_start(&c->flash, address, (items == 2 && strcmp(file, ">")) ? file : NULL,
+			       c->pdu_size) < 0) {
+			isotp_flash_done(ch, FLASH_IMAGE_ERROR);
+			return;
+		}
+		isotp_flash_request(ch);
+
+	} else if(!strncmp("< flashabort ", buf, 13)) {
+		if(c->flash.state != FLASH_IDLE)
+			isotp_flash_done(ch, FLASH_ABORTED);
+
+	} else {
+		METRIC_INC(parse_errors);
+		PRINT_ERROR("unknown command '%s'.\n", buf)
+		strcpy(buf, "< error unknown command >");
+		send(client_socket, buf, strlen(buf), 0);
+	}
+}
+
+void state_isotp() {
+	int i, ch, ret, maxfd;
+	char buf[MAXLEN]; /* inet commands to can */
+	struct timeval timeout;
+
+	if(previous_state != STATE_ISOTP) {
+		for(i=0; i < MAX_ISOTP_CHANNELS; i++) {
+			channels[i].socket = -1;
+			channels[i].tx_head = channels[i].tx_tail = NULL;
+			channels[i].tx_count = 0;
+			channels[i].tx_busy = 0;
+			channels[i].rx_buf = channels[i].tx_part = NULL;
+			channels[i].tx_part_len = 0;
+			flash_init(&channels[i].flash);
+		}
+
+		previous_state = STATE_ISOTP;
+	}
 
 	FD_ZERO(&readfds);
-	FD_SET(si, &readfds);
+	FD_ZERO(&writefds);
 	FD_SET(client_socket, &readfds);
+	maxfd = client_socket;
 
 	/*
 	 * Check if there are more elements in the element buffer before calling select() and
 	 * blocking for new packets.
 	 */
-	if(more_elements) {
-		FD_CLR(si, &readfds);
-	} else {
-		ret = select((si > client_socket)?si+1:client_socket+1, &readfds, NULL, NULL, NULL);
+	if(!more_elements) {
+		for(i=0; i < MAX_ISOTP_CHANNELS; i++) {
+			if(channels[i].socket < 0)
+				continue;
+			FD_SET(channels[i].socket, &readfds);
+			/* wait for the completion of the PDU in transmission */
+			if(channels[i].tx_busy || channels[i].tx_head)
+				FD_SET(channels[i].socket, &writefds);
+			if(channels[i].socket > maxfd)
+				maxfd = channels[i].socket;
+		}
+
+		ret = select(maxfd+1, &readfds, &writefds, NULL, isotp_flash_timeout(&timeout));
 		if(ret < 0) {
 			PRINT_ERROR("Error in select()\n")
 				state = STATE_SHUTDOWN;
 			return;
 		}
-	}
-
-	if (FD_ISSET(si, &readfds)) {
 
-		struct timeval tv = {0};
+		isotp_flash_expire();
 
-		items = read(si, isobuf, ISOTPLEN);
-
-		/* read timestamp data */
-		if(ioctl(si, SIOCGSTAMP, &tv) < 0) {
-			PRINT_ERROR("Could not receive timestamp\n");
-		}
-
-		if (items > 0 && items <= ISOTPLEN) {
-
-			int startlen;
-
-			sprintf(rxmsg, "< pdu %ld.%06ld ", tv.tv_sec, tv.tv_usec);
-			startlen = strlen(rxmsg);
-
-			for (i=0; i < items; i++)
-				sprintf(rxmsg + startlen + 2*i, "%02X", isobuf[i]);
-
-			sprintf(rxmsg + strlen(rxmsg), " >");
-			send(client_socket, rxmsg, strlen(rxmsg), 0);
+		/* completions first as a failed transmission also wakes up the reader */
+		for(i=0; i < MAX_ISOTP_CHANNELS; i++) {
+			if(channels[i].socket >= 0 && FD_ISSET(channels[i].socket, &writefds))
+				isotp_tx_kick(i);
+			if(channels[i].socket >= 0 && FD_ISSET(channels[i].socket, &readfds))
+				isotp_receive(i);
 		}
 	}
 
 	if (FD_ISSET(client_socket, &readfds)) {
 
 		ret = receive_command(client_socket, buf);
+
+		/* only acknowledgement timestamps were pending */
+		if(ret > 0)
+			return;
+
 		if(ret != 0) {
 			state = STATE_SHUTDOWN;
 			return;
 		}
 
 		if (state_changed(buf, state)) {
-			close(si);
+			for(i=0; i < MAX_ISOTP_CHANNELS; i++)
+				isotp_close(i);
 			strcpy(buf, "< ok >");
 			send(client_socket, buf, strlen(buf), 0);
 			return;
@@ -203,38 +780,102 @@ void state_isotp() {
 			return;
 		}
 
-		if(!strncmp("< sendpdu ", buf, 10)) {
-			items = element_length(buf, 2);
-			if (items & 1) {
-				PRINT_ERROR("odd number of ASCII Hex values\n");
+		if(!strncmp("< timestamp ", buf, 12)) {
+			if(timestamp_command(buf) == 0) {
+				for(i=0; i < MAX_ISOTP_CHANNELS; i++) {
+					if(channels[i].socket >= 0)
+						timestamp_enable(channels[i].socket);
+				}
+			}
+			return;
+		}
+
+		if(!strncmp("< rcvbuf ", buf, 9)) {
+			if(rxqueue_command(buf) == 0) {
+				for(i=0; i < MAX_ISOTP_CHANNELS; i++) {
+					if(channels[i].socket >= 0)
+						rxqueue_setup(channels[i].socket, channels[i].bus);
+				}
+			}
+			return;
+		}
+
+		if(bus_tags_command(buf))
+			return;
+
+		/* select the bus of the channel with a bus tag on isotpconf */
+		if(!strncmp("< open ", buf, 7)) {
+			if(open_bus(buf) < 0)
+				strcpy(buf, "< error could not open bus >");
+			else
+				strcpy(buf, "< ok >");
+			send(client_socket, buf, strlen(buf), 0);
+			return;
+		}
+
+		/* configure the untagged channel */
+		if(!strncmp("< isotpconf ", buf, 12)) {
+			if(isotp_open(0, buf, 2) < 0) {
+				state = STATE_SHUTDOWN;
 				return;
 			}
+			channels[0].tagged = 0;
 
-			items /= 2;
-			if (items > ISOTPLEN) {
-				PRINT_ERROR("PDU too long\n");
+		/* configure an additional channel addressed by its handle */
+		} else if(!strncmp("< isotpopen ", buf, 12)) {
+			if(sscanf(buf, "< %*s %d ", &ch) != 1 || ch < 0 || ch >= MAX_ISOTP_CHANNELS) {
+				METRIC_INC(parse_errors);
+				PRINT_ERROR("Syntax error in isotpopen command\n");
 				return;
 			}
 
-			for (i = 0; i < items; i++) {
+			if(isotp_open(ch, buf, 3) < 0) {
+				sprintf(buf, "< error could not open channel %d >", ch);
+				send(client_socket, buf, strlen(buf), 0);
+				return;
+			}
+			channels[ch].tagged = 1;
 
-				tmp = asc2nibble(buf[(2*i) + 10]);
-				if (tmp > 0x0F)
-					return;
-				isobuf[i] = (tmp << 4);
-				tmp = asc2nibble(buf[(2*i) + 11]);
-				if (tmp > 0x0F)
-					return;
-				isobuf[i] |= tmp;
+		} else if(!strncmp("< isotpclose ", buf, 13)) {
+			if(sscanf(buf, "< %*s %d >", &ch) != 1 || ch < 0 || ch >= MAX_ISOTP_CHANNELS) {
+				METRIC_INC(parse_errors);
+				PRINT_ERROR("Syntax error in isotpclose command\n");
+				return;
+			}
+			isotp_close(ch);
+
+		} else if(!strncmp("< isotpbuf ", buf, 11)) {
+			ch = isotp_channel(buf, &i);
+			if(ch < 0)
+				return;
+
+			if(sscanf(element_start(buf, i), "%d >", &ret) != 1 ||
+			   ret < 1 || ret > ISOTP_MAX_PDU) {
+				METRIC_INC(parse_errors);
+				PRINT_ERROR("Syntax error in isotpbuf command\n");
+				return;
 			}
 
-			ret = write(si, isobuf, items);
-			if(ret != items) {
-				PRINT_ERROR("Error in write()\n")
-					state = STATE_SHUTDOWN;
+			/* the receive buffer is allocated again with the new size */
+			channels[ch].pdu_size = ret;
+			free(channels[ch].rx_buf);
+			channels[ch].rx_buf = NULL;
+
+		} else if(!strncmp("< flash", buf, 7)) {
+			isotp_flash_command(buf);
+
+		} else if(!strncmp("< pdupart ", buf, 10)) {
+			if(isotp_send(buf, 0) < 0) {
+				state = STATE_SHUTDOWN;
+				return;
+			}
+		} else if(!strncmp("< sendpdu ", buf, 10)) {
+			if(isotp_send(buf, 1) < 0) {
+				state = STATE_SHUTDOWN;
 				return;
 			}
 		} else {
+			METRIC_INC(parse_errors);
 			PRINT_ERROR("unknown command '%s'.\n", buf)
 				strcpy(buf, "< error unknown command >");
 			send(client_socket, buf, strlen(buf), 0);
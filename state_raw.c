@@ -1,6 +1,12 @@
 #include "config.h"
 #include "socketcand.h"
 #include "statistics.h"
+#include "timestamp.h"
+#include "rxqueue.h"
+#include "transact.h"
+#include "metrics.h"
+#include "probes.h"
+#include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,50 +26,135 @@
 
 #include <linux/can.h>
 
-int raw_socket;
-struct ifreq ifr;
-struct sockaddr_can addr;
-fd_set readfds;
-struct msghdr msg;
-struct can_frame frame;
-struct iovec iov;
-char ctrlmsg[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
-struct timeval tv;
-struct cmsghdr *cmsg;
+static int raw_sockets[MAX_OPEN_BUSSES];
+static int raw_count = 0;
+static __u32 raw_drops[MAX_OPEN_BUSSES];
+static struct ifreq ifr;
+static struct sockaddr_can addr;
+static fd_set readfds;
+static struct msghdr msg;
+static struct can_frame frame;
+static struct iovec iov;
+static char ctrlmsg[TIMESTAMP_CTRLLEN + RXQUEUE_CTRLLEN];
+static struct timespec ts;
 
-void state_raw() {
+/* open and bind the RAW socket for an opened bus */
+static int raw_open(int bus) {
+	int raw_socket;
+
+	if((raw_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		PRINT_ERROR("Error while creating RAW socket %s\n", strerror(errno));
+		return -1;
+	}
+
+	strcpy(ifr.ifr_name, busses[bus].name);
+	if(ioctl(raw_socket, SIOCGIFINDEX, &ifr) < 0) {
+		PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
+		close(raw_socket);
+		return -1;
+	}
+
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	busses[bus].ifindex = ifr.ifr_ifindex;
+
+	if(timestamp_enable(raw_socket) < 0 || rxqueue_setup(raw_socket, bus) < 0) {
+		close(raw_socket);
+		return -1;
+	}
+
+	if(bind(raw_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		PRINT_ERROR("Error while binding RAW socket %s\n", strerror(errno));
+		close(raw_socket);
+		return -1;
+	}
+
+	raw_sockets[bus] = raw_socket;
+	raw_drops[bus] = 0;
+	raw_count = bus + 1;
+
+	return 0;
+}
+
+static void raw_close() {
+	int i;
+
+	for(i=0;i<raw_count;i++)
+		close(raw_sockets[i]);
+
+	raw_count = 0;
+}
+
+/* forward a received frame from one of the RAW sockets to the client */
+static void raw_receive(int bus) {
 	char buf[MAXLEN];
-	int i, ret, items;
+	int i, ret;
+	__u32 drops;
 
-	if(previous_state != STATE_RAW) {
+	iov.iov_len = sizeof(frame);
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_flags = 0;
+	msg.msg_controllen = sizeof(ctrlmsg);
 
-		if((raw_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-			PRINT_ERROR("Error while creating RAW socket %s\n", strerror(errno));
-			state = STATE_SHUTDOWN;
-			return;
-		}
+	ret = recvmsg(raw_sockets[bus], &msg, 0);
+	if(ret < sizeof(struct can_frame)) {
+		PRINT_ERROR_RATELIMITED("Error reading frame from RAW socket\n");
+		return;
+	}
 
-		strcpy(ifr.ifr_name, bus_name);
-		if(ioctl(raw_socket, SIOCGIFINDEX, &ifr) < 0) {
-			PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
-			state = STATE_SHUTDOWN;
-			return;
-		}
+	/* read timestamp data */
+	timestamp_read(&msg, &ts);
 
-		addr.can_family = AF_CAN;
-		addr.can_ifindex = ifr.ifr_ifindex;
+	/* tell the client about frames lost before this one */
+	drops = rxqueue_drops(&msg, &raw_drops[bus]);
+	if(drops)
+		rxqueue_report(bus, drops);
 
-		const int timestamp_on = 1;
-		if(setsockopt( raw_socket, SOL_SOCKET, SO_TIMESTAMP, &timestamp_on, sizeof(timestamp_on)) < 0) {
-			PRINT_ERROR("Could not enable CAN timestamps\n");
-			state = STATE_SHUTDOWN;
-			return;
+	METRIC_BUS_ADD(frames_rx, bus, 1);
+	PROBE5(frame_rx, bus, frame.can_id, frame.can_dlc, ts.tv_sec, ts.tv_nsec);
+
+	if(frame.can_id & CAN_ERR_FLAG) {
+		canid_t class = frame.can_id  & CAN_EFF_MASK;
+		ret = bus_prefix(buf, bus);
+		ret += sprintf(buf+ret, "error %03X ", class);
+		ret += timestamp_format(buf+ret, &ts);
+		sprintf(buf+ret, ">");
+		ret = send(client_socket, buf, strlen(buf), 0);
+		METRIC_SEND(ret, strlen(buf));
+	} else if(frame.can_id & CAN_RTR_FLAG) {
+		/* TODO implement */
+	} else {
+		ret = bus_prefix(buf, bus);
+		if(frame.can_id & CAN_EFF_FLAG) {
+			ret += sprintf(buf+ret, "frame %08X ", frame.can_id & CAN_EFF_MASK);
+		} else {
+			ret += sprintf(buf+ret, "frame %03X ", frame.can_id & CAN_SFF_MASK);
+		}
+		ret += timestamp_format(buf+ret, &ts);
+		for(i=0;i<frame.can_dlc;i++) {
+			ret += sprintf(buf+ret, "%02X", frame.data[i]);
 		}
+		sprintf(buf+ret, " >");
+		PROBE4(frame_format, bus, frame.can_id, buf, ret + 2);
+		ret = latency_send(bus, buf, strlen(buf), &ts);
+		METRIC_SEND(ret, strlen(buf));
+		PROBE3(client_send, bus, strlen(buf), ret);
+	}
+}
 
-		if(bind(raw_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-			PRINT_ERROR("Error while binding RAW socket %s\n", strerror(errno));
-			state = STATE_SHUTDOWN;
-			return;
+void state_raw() {
+	char buf[MAXLEN];
+	int i, ret, items, maxfd;
+	struct timeval timeout;
+
+	if(previous_state != STATE_RAW) {
+
+		for(i=0;i<bus_count;i++) {
+			if(raw_open(i) < 0) {
+				raw_close();
+				state = STATE_SHUTDOWN;
+				return;
+			}
 		}
 
 		iov.iov_base = &frame;
@@ -76,72 +167,49 @@ void state_raw() {
 	}
 
 	FD_ZERO(&readfds);
-	FD_SET(raw_socket, &readfds);
 	FD_SET(client_socket, &readfds);
+	maxfd = client_socket;
 
 	/*
 	 * Check if there are more elements in the element buffer before calling select() and
 	 * blocking for new packets.
 	 */
-	if(more_elements) {
-		FD_CLR(raw_socket, &readfds);
-	} else {
-		ret = select((raw_socket > client_socket)?raw_socket+1:client_socket+1, &readfds, NULL, NULL, NULL);
+	if(!more_elements) {
+		for(i=0;i<raw_count;i++) {
+			FD_SET(raw_sockets[i], &readfds);
+			if(raw_sockets[i] > maxfd)
+				maxfd = raw_sockets[i];
+		}
+
+		maxfd = transact_fds(&readfds, maxfd);
+		ret = select(maxfd+1, &readfds, NULL, NULL, transact_timeout(&timeout));
 
 		if(ret < 0) {
 			PRINT_ERROR("Error in select()\n")
 				state = STATE_SHUTDOWN;
 			return;
 		}
-	}
 
-	if(FD_ISSET(raw_socket, &readfds)) {
-		iov.iov_len = sizeof(frame);
-		msg.msg_namelen = sizeof(addr);
-		msg.msg_flags = 0;
-		msg.msg_controllen = sizeof(ctrlmsg);
-
-		ret = recvmsg(raw_socket, &msg, 0);
-		if(ret < sizeof(struct can_frame)) {
-			PRINT_ERROR("Error reading frame from RAW socket\n")
-				} else {
-			/* read timestamp data */
-			for (cmsg = CMSG_FIRSTHDR(&msg);
-			     cmsg && (cmsg->cmsg_level == SOL_SOCKET);
-			     cmsg = CMSG_NXTHDR(&msg,cmsg)) {
-				if (cmsg->cmsg_type == SO_TIMESTAMP) {
-					tv = *(struct timeval *)CMSG_DATA(cmsg);
-				}
-			}
-
-			if(frame.can_id & CAN_ERR_FLAG) {
-				canid_t class = frame.can_id  & CAN_EFF_MASK;
-				ret = sprintf(buf, "< error %03X %ld.%06ld >", class, tv.tv_sec, tv.tv_usec);
-				send(client_socket, buf, strlen(buf), 0);
-			} else if(frame.can_id & CAN_RTR_FLAG) {
-				/* TODO implement */
-			} else {
-				if(frame.can_id & CAN_EFF_FLAG) {
-					ret = sprintf(buf, "< frame %08X %ld.%06ld ", frame.can_id & CAN_EFF_MASK, tv.tv_sec, tv.tv_usec);
-				} else {
-					ret = sprintf(buf, "< frame %03X %ld.%06ld ", frame.can_id & CAN_SFF_MASK, tv.tv_sec, tv.tv_usec);
-				}
-				for(i=0;i<frame.can_dlc;i++) {
-					ret += sprintf(buf+ret, "%02X", frame.data[i]);
-				}
-				sprintf(buf+ret, " >");
-				send(client_socket, buf, strlen(buf), 0);
-			}
+		for(i=0;i<raw_count;i++) {
+			if(FD_ISSET(raw_sockets[i], &readfds))
+				raw_receive(i);
 		}
 	}
 
+	transact_process(&readfds);
+
 	if(FD_ISSET(client_socket, &readfds)) {
 		ret = receive_command(client_socket, (char *) &buf);
 
+		/* only acknowledgement timestamps were pending */
+		if(ret > 0)
+			return;
+
 		if(ret == 0) {
 
 			if (state_changed(buf, state)) {
-				close(raw_socket);
+				raw_close();
+				transact_close();
 				strcpy(buf, "< ok >");
 				send(client_socket, buf, strlen(buf), 0);
 				return;
@@ -152,6 +220,56 @@ void state_raw() {
 				return;
 			}
 
+			if(!strncmp("< timestamp ", buf, 12)) {
+				if(timestamp_command(buf) == 0) {
+					for(i=0;i<raw_count;i++)
+						timestamp_enable(raw_sockets[i]);
+				}
+				return;
+			}
+
+			if(!strncmp("< latency ", buf, 10)) {
+				latency_command(buf);
+				return;
+			}
+
+			if(!strncmp("< rcvbuf ", buf, 9)) {
+				if(rxqueue_command(buf) == 0) {
+					for(i=0;i<raw_count;i++)
+						rxqueue_setup(raw_sockets[i], i);
+				}
+				return;
+			}
+
+			if(bus_tags_command(buf))
+				return;
+
+			if(!strncmp("< open ", buf, 7)) {
+				i = open_bus(buf);
+				if(i >= raw_count && raw_open(i) < 0) {
+					/* forget the bus again as there is no socket for it */
+					bus_count--;
+					i = -1;
+				}
+
+				if(i < 0) {
+					strcpy(buf, "< error could not open bus >");
+				} else {
+					strcpy(buf, "< ok >");
+				}
+				send(client_socket, buf, strlen(buf), 0);
+				return;
+			}
+
+			/* Send a request and wait for its response */
+			if(!strncmp("< transact ", buf, 11)) {
+				if(transact_command(buf) < 0) {
+					strcpy(buf, "< error could not start transaction >");
+					send(client_socket, buf, strlen(buf), 0);
+				}
+				return;
+			}
+
 			/* Send a single frame */
 			if(!strncmp("< send ", buf, 7)) {
 				items = sscanf(buf, "< %*s %x %hhu "
@@ -171,21 +289,25 @@ void state_raw() {
 				if ( (items < 2) ||
 				     (frame.can_dlc > 8) ||
 				     (items != 2 + frame.can_dlc)) {
-					PRINT_ERROR("Syntax error in send command\n")
-						return;
+					METRIC_INC(parse_errors);
+					PRINT_ERROR_RATELIMITED("Syntax error in send command\n");
+					return;
 				}
 
 				/* < send XXXXXXXX ... > check for extended identifier */
 				if(element_length(buf, 2) == 8)
 					frame.can_id |= CAN_EFF_FLAG;
 
-				ret = send(raw_socket, &frame, sizeof(struct can_frame), 0);
+				ret = send(raw_sockets[current_bus], &frame, sizeof(struct can_frame), 0);
+				PROBE4(frame_tx, current_bus, frame.can_id, frame.can_dlc, ret);
 				if(ret==-1) {
 					state = STATE_SHUTDOWN;
 					return;
 				}
+				METRIC_BUS_ADD(frames_tx, current_bus, 1);
 
 			} else {
+				METRIC_INC(parse_errors);
 				PRINT_ERROR("unknown command '%s'\n", buf);
 				strcpy(buf, "< error unknown command >");
 				send(client_socket, buf, strlen(buf), 0);
@@ -2,136 +2,261 @@
 #include "statistics.h"
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <stdio.h>
-#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/can/netlink.h>
 
 #include "socketcand.h"
+#include "busload.h"
 
 int statistics_ival = 0;
 
-struct timeval last_fired;
+static int stat_timer = -1;
+static int stat_armed = 0;
 
-void *statistics_loop(void *ptr) {
-	int items, found;
-	struct timeval current_time;
-	int elapsed;
-	char buffer[STAT_BUF_LEN];
-	/*int state;
-	  struct can_berr_counter errorcnt;*/
-	FILE *proc_net_dev;
-	struct proc_stat_entry proc_entry;
-	char line[PROC_LINESIZE];
+/* rtnetlink socket of the process, shared by all busses */
+static int nl_socket = -1;
+static pid_t nl_pid = 0;
+static __u32 nl_seq = 0;
 
-	gettimeofday(&last_fired, 0);
+/*
+ * Get the attributes of a network interface with RTM_GETLINK into reply.
+ * Stale replies are skipped by their sequence number. Returns the
+ * RTM_NEWLINK message or NULL on errors.
+ */
+static struct nlmsghdr *link_request(int ifindex, char *reply)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req;
+	struct sockaddr_nl addr;
+	struct nlmsghdr *nh;
+	int len;
 
-	while(1) {
-		/* check if statistics are enabled */
-		if( statistics_ival == 0 ) {
-			sleep(1);
-			continue;
+	/* a socket inherited from the daemon would receive its replies as well */
+	if(nl_socket >= 0 && nl_pid != getpid()) {
+		close(nl_socket);
+		nl_socket = -1;
+	}
+
+	if(nl_socket < 0) {
+		nl_pid = getpid();
+		nl_socket = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if(nl_socket < 0) {
+			PRINT_ERROR("could not open rtnetlink socket: %s\n", strerror(errno));
+			return NULL;
 		}
 
-		/* read /proc/net/dev */
-		proc_net_dev = fopen( "/proc/net/dev", "r" );
-		if( proc_net_dev == NULL ) {
-			PRINT_ERROR("could not open /proc/net/dev");
-			sleep(1);
-			continue;
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		if(bind(nl_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			PRINT_ERROR("could not bind rtnetlink socket: %s\n", strerror(errno));
+			close(nl_socket);
+			nl_socket = -1;
+			return NULL;
 		}
+	}
 
-		found=0;
-		while(1) {
-			if(fgets( line , PROC_LINESIZE, proc_net_dev ) == NULL)
-				break;
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = ++nl_seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
 
-			/* extract name */
-			char* s = (char *) &line;
-			char* name = strsep(&s, ":");
-			if(s == NULL) { /* no : in line */
-				continue;
-			}
+	if(send(nl_socket, &req, req.nh.nlmsg_len, 0) < 0)
+		return NULL;
 
-			/* remove heading whitespace */
-			int pos = 0;
-			for(;pos<strlen(name);pos++)
-				if(name[pos] != ' ')
-					break;
-			name += pos;
+	while(1) {
+		len = recv(nl_socket, reply, NL_BUF_LEN, 0);
+		if(len < 0)
+			return NULL;
 
-			/* do we care for this device? */
-			if(strcmp(bus_name, name))
+		for(nh = (struct nlmsghdr *) reply; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if(nh->nlmsg_seq != nl_seq)
 				continue;
 
-			items = sscanf( s, " %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u",
-					&proc_entry.rbytes,
-					&proc_entry.rpackets,
-					&proc_entry.rerrs,
-					&proc_entry.rdrop,
-					&proc_entry.rfifo,
-					&proc_entry.rframe,
-					&proc_entry.rcompressed,
-					&proc_entry.rmulticast,
-					&proc_entry.tbytes,
-					&proc_entry.tpackets,
-					&proc_entry.terrs,
-					&proc_entry.tdrop,
-					&proc_entry.tfifo,
-					&proc_entry.tcolls,
-					&proc_entry.tcarrier,
-					&proc_entry.tcompressed );
-
-			if( items == 16 ) {
-				found=1;
-				break;
-			}
+			return (nh->nlmsg_type == RTM_NEWLINK) ? nh : NULL;
 		}
-		fclose(proc_net_dev);
+	}
+}
 
-		/* If we didn't find the device there is something wrong. */
-		if(!found) {
-			PRINT_ERROR("could not find device %s in /proc/net/dev\n", bus_name);
-			sleep(1);
+/* get the 64 bit counters of a network interface, returns -1 on errors */
+int statistics_link(int ifindex, struct rtnl_link_stats64 *stats)
+{
+	char reply[NL_BUF_LEN];
+	struct nlmsghdr *nh;
+	struct rtattr *rta;
+	int attrlen;
+
+	if(!(nh = link_request(ifindex, reply)))
+		return -1;
+
+	attrlen = IFLA_PAYLOAD(nh);
+	for(rta = IFLA_RTA((struct ifinfomsg *) NLMSG_DATA(nh)); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+		if(rta->rta_type == IFLA_STATS64) {
+			/* older kernels send fewer counters, the missing ones are 0 */
+			memset(stats, 0, sizeof(*stats));
+			memcpy(stats, RTA_DATA(rta), (RTA_PAYLOAD(rta) < sizeof(*stats)) ? RTA_PAYLOAD(rta) : sizeof(*stats));
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Get the nominal and data bitrate of a CAN interface from the bit timing
+ * in IFLA_LINKINFO. Rates that are not reported are left unchanged.
+ */
+void statistics_bitrate(int ifindex, __u32 *bitrate, __u32 *dbitrate)
+{
+	char reply[NL_BUF_LEN];
+	struct nlmsghdr *nh;
+	struct rtattr *rta, *info, *data;
+	struct can_bittiming bt;
+	int attrlen, infolen, datalen;
+
+	if(!(nh = link_request(ifindex, reply)))
+		return;
+
+	attrlen = IFLA_PAYLOAD(nh);
+	for(rta = IFLA_RTA((struct ifinfomsg *) NLMSG_DATA(nh)); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+		if(rta->rta_type != IFLA_LINKINFO)
 			continue;
+
+		infolen = RTA_PAYLOAD(rta);
+		for(info = RTA_DATA(rta); RTA_OK(info, infolen); info = RTA_NEXT(info, infolen)) {
+			if(info->rta_type != IFLA_INFO_DATA)
+				continue;
+
+			datalen = RTA_PAYLOAD(info);
+			for(data = RTA_DATA(info); RTA_OK(data, datalen); data = RTA_NEXT(data, datalen)) {
+				if(RTA_PAYLOAD(data) < sizeof(bt))
+					continue;
+				memcpy(&bt, RTA_DATA(data), sizeof(bt));
+				if(data->rta_type == IFLA_CAN_BITTIMING && bt.bitrate)
+					*bitrate = bt.bitrate;
+				else if(data->rta_type == IFLA_CAN_DATA_BITTIMING && bt.bitrate)
+					*dbitrate = bt.bitrate;
+			}
 		}
+	}
+}
+
+/* arm the timer with the interval in milliseconds, 0 disarms it */
+static int statistics_arm(int ival) {
+	struct itimerspec its;
 
-		gettimeofday(&current_time, 0);
-
-		elapsed = ((current_time.tv_sec - last_fired.tv_sec) * 1000
-			   + (current_time.tv_usec - last_fired.tv_usec)/1000.0) + 0.5;
-
-		if(elapsed >= statistics_ival) {
-
-			/*
-			 * TODO this does not work for virtual devices. therefore it is commented out until
-			 * a solution is found to identify virtual CAN devices
-			 */
-			/*if( can_get_state( current_entry.bus_name, &state ) ) {
-			  printf( "unable to get state of %s\n", current_entry.bus_name );
-			  continue;
-			  }
-			  if( can_get_berr_counter( current_entry.bus_name, &errorcnt ) ) {
-			  printf( "unable to get error count of %s\n", current_entry.bus_name );
-			  continue;
-			  }*/
-
-			snprintf( buffer, STAT_BUF_LEN, "< stat %u %u %u %u >",
-				  proc_entry.rbytes,
-				  proc_entry.rpackets,
-				  proc_entry.tbytes,
-				  proc_entry.tpackets);
-
-			/* no lock needed here because POSIX send is thread-safe and does locking itself */
-			send( client_socket, buffer, strlen(buffer), 0 );
-
-			last_fired.tv_sec = current_time.tv_sec;
-			last_fired.tv_usec = current_time.tv_usec;
+	if(stat_timer < 0) {
+		if(!ival)
+			return 0;
+
+		stat_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(stat_timer < 0) {
+			PRINT_ERROR("could not create statistics timer: %s\n", strerror(errno));
+			return -1;
 		}
+	}
 
-		usleep(10000);
+	its.it_value.tv_sec = ival / 1000;
+	its.it_value.tv_nsec = (ival % 1000) * 1000000;
+	its.it_interval = its.it_value;
+
+	if(timerfd_settime(stat_timer, 0, &its, NULL) < 0) {
+		PRINT_ERROR("could not set statistics timer: %s\n", strerror(errno));
+		return -1;
 	}
 
-	return NULL;
+	stat_armed = (ival != 0);
+
+	/* the bus load is only measured while it is reported */
+	if(stat_armed)
+		busload_open();
+	else
+		busload_close();
+
+	return 0;
+}
+
+/*
+ * Set the interval of the statistics in milliseconds. The statistics are
+ * driven by a timer in the event loop of the connection, which is disarmed
+ * for 0 so that disabled statistics cause no wakeups.
+ */
+int statistics_start(int ival) {
+	if(statistics_arm(ival) < 0)
+		return -1;
+
+	statistics_ival = ival;
+	return 0;
+}
+
+/* stop the timer when leaving control mode, the interval is kept */
+void statistics_stop() {
+	statistics_arm(0);
+}
+
+/* the timer to wait for in select() or -1 if statistics are disabled */
+int statistics_fd() {
+	return stat_armed ? stat_timer : -1;
+}
+
+/* send the statistics of all opened busses when the timer has expired */
+void statistics_send() {
+	int i, items;
+	char buffer[STAT_BUF_LEN];
+	/*int state;
+	  struct can_berr_counter errorcnt;*/
+	struct rtnl_link_stats64 stats;
+	uint64_t expirations;
+
+	if(read(stat_timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	/*
+	 * TODO this does not work for virtual devices. therefore it is commented out until
+	 * a solution is found to identify virtual CAN devices
+	 */
+	/*if( can_get_state( current_entry.bus_name, &state ) ) {
+	  printf( "unable to get state of %s\n", current_entry.bus_name );
+	  continue;
+	  }
+	  if( can_get_berr_counter( current_entry.bus_name, &errorcnt ) ) {
+	  printf( "unable to get error count of %s\n", current_entry.bus_name );
+	  continue;
+	  }*/
+
+	for(i=0;i<bus_count;i++) {
+		if(!busses[i].ifindex)
+			busses[i].ifindex = if_nametoindex(busses[i].name);
+
+		if(statistics_link(busses[i].ifindex, &stats) < 0) {
+			PRINT_ERROR("could not get statistics of %s\n", busses[i].name);
+			continue;
+		}
+
+		items = bus_prefix(buffer, i);
+		snprintf( buffer + items, STAT_BUF_LEN - items, "stat %llu %llu %llu %llu %u >",
+			  (unsigned long long) stats.rx_bytes,
+			  (unsigned long long) stats.rx_packets,
+			  (unsigned long long) stats.tx_bytes,
+			  (unsigned long long) stats.tx_packets,
+			  busses[i].rx_drops);
+
+		send( client_socket, buffer, strlen(buffer), 0 );
+
+		busload_report(i);
+	}
 }
@@ -1,28 +1,13 @@
-#include <pthread.h>
+#include <linux/types.h>
+#include <linux/if_link.h>
 
 #define STAT_BUF_LEN 512
-#define PROC_LINESIZE 256
-#define PROC_LINECOUNT 32
+#define NL_BUF_LEN 8192
 
 extern int statistics_ival;
-void *statistics_loop(void *ptr);
-
-struct proc_stat_entry {
-	char device_name[6];
-	unsigned int rbytes;
-	unsigned int rpackets;
-	unsigned int rerrs;
-	unsigned int rdrop;
-	unsigned int rfifo;
-	unsigned int rframe;
-	unsigned int rcompressed;
-	unsigned int rmulticast;
-	unsigned int tbytes;
-	unsigned int tpackets;
-	unsigned int terrs;
-	unsigned int tdrop;
-	unsigned int tfifo;
-	unsigned int tcolls;
-	unsigned int tcarrier;
-	unsigned int tcompressed;
-};
+int statistics_start(int ival);
+void statistics_stop();
+int statistics_fd();
+void statistics_send();
+int statistics_link(int ifindex, struct rtnl_link_stats64 *stats);
+void statistics_bitrate(int ifindex, __u32 *bitrate, __u32 *dbitrate);
@@ -0,0 +1,149 @@
+#include "config.h"
+#include "socketcand.h"
+#include "timestamp.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/sockios.h>
+#include <linux/net_tstamp.h>
+
+int timestamp_source = TIMESTAMP_SOFTWARE;
+int timestamp_nsec = 0;
+
+/*
+ * Switch the timestamping of a CAN socket to the currently selected source.
+ * The timestamps are delivered as control messages with every recvmsg() so
+ * that no additional SIOCGSTAMP ioctl is needed per received message.
+ */
+int timestamp_enable(int socket)
+{
+	int ns_on = 0;
+	int flags = 0;
+
+	if(timestamp_source == TIMESTAMP_SOFTWARE) {
+		ns_on = 1;
+	} else if(timestamp_source == TIMESTAMP_HARDWARE) {
+		struct ifreq ifr;
+		struct hwtstamp_config hwconfig;
+		int i;
+
+		/* fall back to software timestamps if the controller provides none */
+		flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+			SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+		/* some drivers only deliver hardware timestamps after being asked to */
+		for(i=0;i<bus_count;i++) {
+			memset(&hwconfig, 0, sizeof(hwconfig));
+			hwconfig.tx_type = HWTSTAMP_TX_OFF;
+			hwconfig.rx_filter = HWTSTAMP_FILTER_ALL;
+			memset(&ifr, 0, sizeof(ifr));
+			strncpy(ifr.ifr_name, busses[i].name, IFNAMSIZ-1);
+			ifr.ifr_data = (void *) &hwconfig;
+			if(ioctl(socket, SIOCSHWTSTAMP, &ifr) < 0) {
+				PRINT_VERBOSE("Could not enable hardware timestamps on %s: %s\n", busses[i].name, strerror(errno));
+			}
+		}
+	}
+
+	if(setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0 && flags) {
+		PRINT_ERROR("Could not enable hardware timestamps\n");
+		return -1;
+	}
+
+	if(setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS, &ns_on, sizeof(ns_on)) < 0 && ns_on) {
+		PRINT_ERROR("Could not enable CAN timestamps\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse '< timestamp source [precision] >' and store the new settings.
+ * Returns -1 on a syntax error.
+ */
+int timestamp_command(char *buf)
+{
+	char source[16], precision[16];
+	int items;
+
+	items = sscanf(buf, "< %*s %15[a-z] %15[a-z] >", source, precision);
+
+	if(items < 1) {
+		METRIC_INC(parse_errors);
+		PRINT_ERROR("Syntax error in timestamp command\n");
+		return -1;
+	}
+
+	if(!strcmp(source, "software"))
+		timestamp_source = TIMESTAMP_SOFTWARE;
+	else if(!strcmp(source, "hardware"))
+		timestamp_source = TIMESTAMP_HARDWARE;
+	else if(!strcmp(source, "none"))
+		timestamp_source = TIMESTAMP_NONE;
+	else {
+		PRINT_ERROR("Unknown timestamp source '%s'\n", source);
+		return -1;
+	}
+
+	if(items < 2 || !strcmp(precision, "usec"))
+		timestamp_nsec = 0;
+	else if(!strcmp(precision, "nsec"))
+		timestamp_nsec = 1;
+	else {
+		PRINT_ERROR("Unknown timestamp precision '%s'\n", precision);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* extract the timestamp of the selected source from the control messages */
+void timestamp_read(struct msghdr *msg, struct timespec *ts)
+{
+	struct cmsghdr *cmsg;
+
+	ts->tv_sec = 0;
+	ts->tv_nsec = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg);
+	     cmsg && (cmsg->cmsg_level == SOL_SOCKET);
+	     cmsg = CMSG_NXTHDR(msg,cmsg)) {
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+		} else if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			struct scm_timestamping stamps;
+
+			memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+			/* ts[2] holds the raw hardware timestamp, ts[0] the software one */
+			if(stamps.ts[2].tv_sec || stamps.ts[2].tv_nsec)
+				*ts = stamps.ts[2];
+			else
+				*ts = stamps.ts[0];
+		}
+	}
+}
+
+/*
+ * Print the timestamp element including the trailing space into buf.
+ * Nothing is printed when timestamps are disabled. Returns the number of
+ * characters written.
+ */
+int timestamp_format(char *buf, struct timespec *ts)
+{
+	if(timestamp_source == TIMESTAMP_NONE) {
+		buf[0] = '\0';
+		return 0;
+	}
+
+	if(timestamp_nsec)
+		return sprintf(buf, "%ld.%09ld ", ts->tv_sec, ts->tv_nsec);
+
+	return sprintf(buf, "%ld.%06ld ", ts->tv_sec, ts->tv_nsec / 1000);
+}
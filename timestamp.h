@@ -0,0 +1,18 @@
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#define TIMESTAMP_SOFTWARE 0
+#define TIMESTAMP_HARDWARE 1
+#define TIMESTAMP_NONE 2
+
+/* space for the timestamp control messages delivered with each recvmsg() */
+#define TIMESTAMP_CTRLLEN CMSG_SPACE(sizeof(struct scm_timestamping))
+
+extern int timestamp_source;
+extern int timestamp_nsec;
+
+int timestamp_enable(int socket);
+int timestamp_command(char *buf);
+void timestamp_read(struct msghdr *msg, struct timespec *ts);
+int timestamp_format(char *buf, struct timespec *ts);
@@ -0,0 +1,344 @@
+#include "config.h"
+#include "socketcand.h"
+#include "timestamp.h"
+#include "transact.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <net/if.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+/*
+ * A request sent with '< transact >' waiting for its response. Each
+ * transaction has its own RAW socket whose filter only passes the
+ * response and the echo of the request, so unrelated traffic never
+ * reaches the daemon.
+ */
+struct transaction {
+	int socket; /* -1 if the slot is free */
+	unsigned int handle;
+	int bus;
+	canid_t tx_id;
+	canid_t rx_id;
+	canid_t rx_mask;
+	struct timespec tx_ts; /* time of the request, replaced by its echo */
+	struct timespec deadline;
+};
+
+static struct transaction transactions[MAX_TRANSACTIONS];
+static int transact_initialized = 0;
+
+static void transact_init(void)
+{
+	int i;
+
+	for(i=0;i<MAX_TRANSACTIONS;i++)
+		transactions[i].socket = -1;
+
+	transact_initialized = 1;
+}
+
+static void transact_end(struct transaction *t)
+{
+	close(t->socket);
+	t->socket = -1;
+}
+
+/* report the response of a transaction */
+static void transact_response(struct transaction *t, struct can_frame *frame, struct timespec *rx_ts)
+{
+	char buf[128];
+	int i, len;
+
+	len = bus_prefix(buf, t->bus);
+	if(frame->can_id & CAN_EFF_FLAG)
+		len += sprintf(buf + len, "response %u %08X ", t->handle, frame->can_id & CAN_EFF_MASK);
+	else
+		len += sprintf(buf + len, "response %u %03X ", t->handle, frame->can_id & CAN_SFF_MASK);
+	len += timestamp_format(buf + len, &t->tx_ts);
+	len += timestamp_format(buf + len, rx_ts);
+	for(i=0;i<frame->can_dlc;i++)
+		len += sprintf(buf + len, "%02X", frame->data[i]);
+	sprintf(buf + len, " >");
+	send(client_socket, buf, strlen(buf), 0);
+
+	transact_end(t);
+}
+
+/* report a transaction without response */
+static void transact_noresponse(struct transaction *t)
+{
+	char buf[64];
+	int len;
+
+	len = bus_prefix(buf, t->bus);
+	len += sprintf(buf + len, "noresponse %u ", t->handle);
+	len += timestamp_format(buf + len, &t->tx_ts);
+	sprintf(buf + len, ">");
+	send(client_socket, buf, strlen(buf), 0);
+
+	transact_end(t);
+}
+
+/*
+ * Handle '< transact handle timeout_s timeout_us rx_id rx_mask can_id can_dlc data >'.
+ * The frame is sent on the current bus and the first frame with
+ * (can_id & rx_mask) == (rx_id & rx_mask) received afterwards is returned.
+ */
+int transact_command(char *buf)
+{
+	struct transaction *t = NULL;
+	struct can_frame frame;
+	struct can_filter filter[2];
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	unsigned long sec, usec;
+	const int on = 1;
+	int i, items;
+
+	if(!transact_initialized)
+		transact_init();
+
+	memset(&frame, 0, sizeof(frame));
+
+	for(i=0;i<MAX_TRANSACTIONS;i++) {
+		if(transactions[i].socket < 0) {
+			t = &transactions[i];
+			break;
+		}
+	}
+
+	if(!t) {
+		PRINT_ERROR("Too many transactions\n");
+		return -1;
+	}
+
+	items = sscanf(buf, "< %*s %u %lu %lu %x %x %x %hhu "
+		       "%hhx %hhx %hhx %hhx %hhx %hhx "
+		       "%hhx %hhx >",
+		       &t->handle,
+		       &sec,
+		       &usec,
+		       &t->rx_id,
+		       &t->rx_mask,
+		       &frame.can_id,
+		       &frame.can_dlc,
+		       &frame.data[0],
+		       &frame.data[1],
+		       &frame.data[2],
+		       &frame.data[3],
+		       &frame.data[4],
+		       &frame.data[5],
+		       &frame.data[6],
+		       &frame.data[7]);
+
+	if ( (items < 7) ||
+	     (frame.can_dlc > 8) ||
+	     (items != 7 + frame.can_dlc)) {
+		METRIC_INC(parse_errors);
+		PRINT_ERROR("Syntax error in transact command\n");
+		return -1;
+	}
+
+	/* the responses of two pending transactions could not be told apart */
+	for(i=0;i<MAX_TRANSACTIONS;i++) {
+		if(transactions[i].socket >= 0 && transactions[i].handle == t->handle) {
+			PRINT_ERROR("Transaction %u is already pending\n", t->handle);
+			return -1;
+		}
+	}
+
+	/* < transact handle sec usec XXXXXXXX mask XXXXXXXX ... > check for extended identifiers */
+	if(element_length(buf, 5) == 8)
+		t->rx_id |= CAN_EFF_FLAG;
+	if(element_length(buf, 7) == 8)
+		frame.can_id |= CAN_EFF_FLAG;
+	t->tx_id = frame.can_id;
+
+	/* the response and the echo of the request with the same frame type */
+	filter[0].can_id = t->rx_id;
+	filter[0].can_mask = (t->rx_mask & CAN_EFF_MASK) | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	filter[1].can_id = t->tx_id;
+	filter[1].can_mask = CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+
+	if((t->socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		PRINT_ERROR("Error while creating RAW socket %s\n", strerror(errno));
+		return -1;
+	}
+
+	strcpy(ifr.ifr_name, busses[current_bus].name);
+	if(ioctl(t->socket, SIOCGIFINDEX, &ifr) < 0) {
+		PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
+		transact_end(t);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+
+	setsockopt(t->socket, SOL_CAN_RAW, CAN_RAW_FILTER, &filter, sizeof(filter));
+	setsockopt(t->socket, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &on, sizeof(on));
+
+	if(timestamp_enable(t->socket) < 0 ||
+	   bind(t->socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		PRINT_ERROR("Error while binding RAW socket %s\n", strerror(errno));
+		transact_end(t);
+		return -1;
+	}
+
+	/* used as transmission time if the request is not echoed */
+	clock_gettime(CLOCK_REALTIME, &t->tx_ts);
+
+	if(send(t->socket, &frame, sizeof(frame), 0) < 0) {
+		PRINT_ERROR_RATELIMITED("Error sending transaction %u: %s\n", t->handle, strerror(errno));
+		transact_end(t);
+		return -1;
+	}
+
+	t->bus = current_bus;
+	clock_gettime(CLOCK_MONOTONIC, &t->deadline);
+	t->deadline.tv_sec += sec + usec / 1000000;
+	t->deadline.tv_nsec += (usec % 1000000) * 1000;
+	if(t->deadline.tv_nsec >= 1000000000) {
+		t->deadline.tv_sec++;
+		t->deadline.tv_nsec -= 1000000000;
+	}
+
+	return 0;
+}
+
+/* add the sockets of the pending transactions to readfds */
+int transact_fds(fd_set *readfds, int maxfd)
+{
+	int i;
+
+	if(!transact_initialized)
+		return maxfd;
+
+	for(i=0;i<MAX_TRANSACTIONS;i++) {
+		if(transactions[i].socket < 0)
+			continue;
+		FD_SET(transactions[i].socket, readfds);
+		if(transactions[i].socket > maxfd)
+			maxfd = transactions[i].socket;
+	}
+
+	return maxfd;
+}
+
+/*
+ * Get the timeout for select() until the next transaction expires.
+ * Returns NULL if no transaction is pending.
+ */
+struct timeval *transact_timeout(struct timeval *tv)
+{
+	struct timespec now, *first = NULL;
+	long long usec;
+	int i;
+
+	if(!transact_initialized)
+		return NULL;
+
+	for(i=0;i<MAX_TRANSACTIONS;i++) {
+		if(transactions[i].socket < 0)
+			continue;
+		if(!first || transactions[i].deadline.tv_sec < first->tv_sec ||
+		   (transactions[i].deadline.tv_sec == first->tv_sec &&
+		    transactions[i].deadline.tv_nsec < first->tv_nsec))
+			first = &transactions[i].deadline;
+	}
+
+	if(!first)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (first->tv_sec - now.tv_sec) * 1000000LL + (first->tv_nsec - now.tv_nsec) / 1000;
+	if(usec < 0)
+		usec = 0;
+
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+	return tv;
+}
+
+/* read the sockets of the transactions in readfds and expire the others */
+void transact_process(fd_set *readfds)
+{
+	struct transaction *t;
+	struct can_frame frame;
+	struct timespec now, ts;
+	struct iovec iov;
+	struct msghdr msg;
+	char ctrlmsg[TIMESTAMP_CTRLLEN];
+	int i, ret;
+
+	if(!transact_initialized)
+		return;
+
+	for(i=0;i<MAX_TRANSACTIONS;i++) {
+		t = &transactions[i];
+		if(t->socket < 0 || !FD_ISSET(t->socket, readfds))
+			continue;
+
+		iov.iov_base = &frame;
+		iov.iov_len = sizeof(frame);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &ctrlmsg;
+		msg.msg_controllen = sizeof(ctrlmsg);
+
+		ret = recvmsg(t->socket, &msg, MSG_DONTWAIT);
+		if(ret < (int) sizeof(frame))
+			continue;
+
+		timestamp_read(&msg, &ts);
+
+		/* the echo of the request carries the transmission time */
+		if(msg.msg_flags & MSG_CONFIRM) {
+			t->tx_ts = ts;
+			continue;
+		}
+
+		if(((frame.can_id ^ t->rx_id) & ((t->rx_mask & CAN_EFF_MASK) | CAN_EFF_FLAG | CAN_RTR_FLAG)) == 0)
+			transact_response(t, &frame, &ts);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for(i=0;i<MAX_TRANSACTIONS;i++) {
+		t = &transactions[i];
+		if(t->socket < 0)
+			continue;
+		if(now.tv_sec > t->deadline.tv_sec ||
+		   (now.tv_sec == t->deadline.tv_sec && now.tv_nsec >= t->deadline.tv_nsec))
+			transact_noresponse(t);
+	}
+}
+
+/* drop all pending transactions, e.g. when the mode is changed */
+void transact_close(void)
+{
+	int i;
+
+	if(!transact_initialized)
+		return;
+
+	for(i=0;i<MAX_TRANSACTIONS;i++) {
+		if(transactions[i].socket >= 0)
+			transact_end(&transactions[i]);
+	}
+}
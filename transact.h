@@ -0,0 +1,10 @@
+#include <sys/select.h>
+#include <sys/time.h>
+
+#define MAX_TRANSACTIONS 64
+
+int transact_command(char *buf);
+int transact_fds(fd_set *readfds, int maxfd);
+struct timeval *transact_timeout(struct timeval *tv);
+void transact_process(fd_set *readfds);
+void transact_close(void);